@@ -0,0 +1,157 @@
+// Decoder for the binary damage traces written by "dmgtrace start <file>".
+//
+// Usage: dmgtrace <tracefile> [-summary]
+//
+// Prints one line per record, or with -summary only the per-exit counts.
+// The trace is written in the byte order of the machine that recorded it,
+// and this tool expects the same.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+enum { DTS_NUM = 7 };
+static const int32_t DTS_NOTREACHED = INT32_MIN;
+
+// Must match FDamageTraceRecord.
+struct TraceRecord
+{
+    uint32_t Tic;
+    uint8_t Kind;
+    uint8_t Exit;
+    uint8_t Flags;
+    int8_t TargetPlayer;
+    uint32_t Target, Inflictor, Source;
+    uint16_t DamageType;
+    int16_t SourcePlayer;
+    int32_t RawDamage;
+    int32_t Stage[DTS_NUM];
+    int32_t Result;
+    uint32_t Pad;
+};
+
+static const char *const KindNames[] = { "damage", "death", "dropped" };
+
+static const char *const StageNames[DTS_NUM] =
+{
+    "skill", "special", "multiply", "protection", "factor", "armor", "teamdamage"
+};
+
+static const char *const ExitNames[] =
+{
+    "none", "damaged", "unshootable", "spectral", "alreadydead", "invulnerable",
+    "dormant", "cancelled", "nullified", "friendly", "godmode", "fakepain",
+    "pain", "wound", "death", "buddha",
+    "state", "destroyed", "missile", "unmorphed", "morphed",
+};
+enum { NUM_EXITS = sizeof(ExitNames) / sizeof(ExitNames[0]) };
+
+int main (int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf (stderr, "Usage: %s <tracefile> [-summary]\n", argv[0]);
+        return 1;
+    }
+    bool summary = argc > 2 && strcmp (argv[2], "-summary") == 0;
+
+    FILE *f = fopen (argv[1], "rb");
+    if (f == NULL)
+    {
+        perror (argv[1]);
+        return 1;
+    }
+
+    uint32_t header[4];
+    if (fread (header, sizeof(header), 1, f) != 1 || memcmp (header, "DMGT", 4) != 0)
+    {
+        fprintf (stderr, "%s: not a damage trace\n", argv[1]);
+        return 1;
+    }
+    if (header[1] != 1 || header[2] != sizeof(TraceRecord))
+    {
+        fprintf (stderr, "%s: unsupported trace version %u (record size %u)\n", argv[1], header[1], header[2]);
+        return 1;
+    }
+
+    std::vector<std::string> types;
+    for (uint32_t i = 0; i < header[3]; ++i)
+    {
+        std::string name;
+        int c;
+        while ((c = fgetc (f)) > 0)
+        {
+            name += (char)c;
+        }
+        types.push_back (name);
+    }
+
+    unsigned long counts[2][NUM_EXITS] = { { 0 } };
+    unsigned long dropped = 0;
+    TraceRecord rec;
+
+    while (fread (&rec, sizeof(rec), 1, f) == 1)
+    {
+        if (rec.Kind == 2)
+        {
+            dropped += rec.RawDamage;
+            if (!summary) printf ("-- %d records dropped\n", rec.RawDamage);
+            continue;
+        }
+        if (rec.Kind > 1 || rec.Exit >= NUM_EXITS)
+        {
+            fprintf (stderr, "corrupt record\n");
+            break;
+        }
+        counts[rec.Kind][rec.Exit]++;
+        if (summary)
+        {
+            continue;
+        }
+
+        const char *type = rec.DamageType < types.size() ? types[rec.DamageType].c_str() : "?";
+        printf ("%8u %-6s %08x", rec.Tic, KindNames[rec.Kind], rec.Target);
+        if (rec.TargetPlayer >= 0) printf (" (player %d)", rec.TargetPlayer);
+        printf (" by %08x/%08x", rec.Inflictor, rec.Source);
+        if (rec.SourcePlayer >= 0) printf (" (player %d)", rec.SourcePlayer);
+        printf (" type %s", type);
+
+        if (rec.Kind == 0)
+        {
+            printf (" raw %d", rec.RawDamage);
+            for (int i = 0; i < DTS_NUM; ++i)
+            {
+                if (rec.Stage[i] != DTS_NOTREACHED)
+                {
+                    printf (" %s %d", StageNames[i], rec.Stage[i]);
+                }
+            }
+            printf (" -> %d", rec.Result);
+        }
+        else
+        {
+            printf (" health %d", rec.Result);
+        }
+        printf (" [%s]%s\n", ExitNames[rec.Exit], (rec.Flags & 1) ? " predicting" : "");
+    }
+    fclose (f);
+
+    for (int kind = 0; kind < 2; ++kind)
+    {
+        printf ("%s exits:\n", KindNames[kind]);
+        for (int i = 0; i < NUM_EXITS; ++i)
+        {
+            if (counts[kind][i] != 0)
+            {
+                printf ("  %-14s %lu\n", ExitNames[i], counts[kind][i]);
+            }
+        }
+    }
+    if (dropped != 0)
+    {
+        printf ("dropped: %lu\n", dropped);
+    }
+    return 0;
+}
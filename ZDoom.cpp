@@ -1,12 +1,2185 @@
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#endif
+
+//==========================================================================
+//
+// FInventoryIndex
+//
+// Every actor keeps a short, flat list of the inventory items that can
+// actually change incoming or outgoing damage, in inventory order, so a
+// hit on an actor that carries none of them skips the virtual calls down
+// its inventory chain. When there is one, the call still goes to the head
+// of the chain and every item passes it on as before, so each item is
+// applied exactly once. The index is only ever used to decide whether to
+// make that call; its items are never called through it, so an item that
+// has been removed since the index was built costs a walk, not a crash.
+//
+// AActor::AddInventory hands out a new InventoryID for every item, and
+// AActor::ObtainInventory, which morphing uses to hand the whole chain to
+// another actor, changes the head of the chain. The index remembers both
+// when it is built and is rebuilt as soon as either has changed, so an
+// item that was added is never missed.
+//
+// The index also lists the items that react to their owner's death
+// (powerups, which go away with it) and the health items that can be used
+// automatically, so dying and lethal hits only walk the inventory when
+// there is something in it that cares.
+//
+//==========================================================================
+
+void FInventoryIndex::Clear ()
+{
+    ActiveModifiers.Clear();
+    PassiveModifiers.Clear();
+    Absorbers.Clear();
+    DeathSubscribers.Clear();
+    HealthItems.Clear();
+}
+
+void FInventoryIndex::Rebuild (AActor *owner)
+{
+    Clear();
+    for (AInventory *item = owner->Inventory; item != NULL; item = item->Inventory)
+    {
+        if (item->IsKindOf (RUNTIME_CLASS(APowerDamage)))
+        {
+            ActiveModifiers.Push (item);
+        }
+        else if (item->IsKindOf (RUNTIME_CLASS(APowerProtection)))
+        {
+            PassiveModifiers.Push (item);
+        }
+        else if (item->IsKindOf (RUNTIME_CLASS(AArmor)) || item->IsKindOf (RUNTIME_CLASS(APowerIronFeet)))
+        {
+            Absorbers.Push (item);
+        }
+        else if (item->IsKindOf (RUNTIME_CLASS(AHealthPickup)) && static_cast<AHealthPickup *>(item)->autousemode != 0)
+        {
+            HealthItems.Push (item);
+        }
+
+        // Not exclusive with the above: protection powers and the like
+        // are powerups too.
+        if (item->IsKindOf (RUNTIME_CLASS(APowerup)))
+        {
+            DeathSubscribers.Push (item);
+        }
+    }
+    Head = owner->Inventory;
+    InventoryID = owner->InventoryID;
+    Valid = true;
+}
+
+void AActor::InvalidateInventoryIndex ()
+{
+    InvIndex.Valid = false;
+}
+
+const FInventoryIndex &AActor::GetInventoryIndex ()
+{
+    if (!InvIndex.Valid || InvIndex.Head != Inventory || InvIndex.InventoryID != InventoryID)
+    {
+        InvIndex.Rebuild (this);
+    }
+    return InvIndex;
+}
+
+// The owner must have inventory.
+static void P_ModifyDamage (AActor *owner, int &damage, FName mod, bool passive)
+{
+    const FInventoryIndex &index = owner->GetInventoryIndex();
+    if ((passive ? index.PassiveModifiers : index.ActiveModifiers).Size() > 0)
+    {
+        owner->Inventory->ModifyDamage (damage, mod, damage, passive);
+    }
+}
+
+static void P_AbsorbDamage (AActor *owner, int damage, FName mod, int &newdamage)
+{
+    if (owner->GetInventoryIndex().Absorbers.Size() > 0)
+    {
+        owner->Inventory->AbsorbDamage (damage, mod, newdamage);
+    }
+}
+
+//==========================================================================
+//
+// Damage type IDs
+//
+// Damage types are interned to small dense IDs when the combat tables are
+// built, so those tables can be plain arrays indexed by damage type. The
+// name -> ID map is itself an array indexed by the name's index, so
+// converting a damage type on the hot path is a single load.
+//
+// ID 0 stands for every name that was never interned, e.g. a damage type
+// that only shows up at run time through ACS. No class has states or pain
+// chances for such a type, so only its damage factor needs the slow path.
+//
+//==========================================================================
+
+enum
+{
+    DMGTYPE_Unknown,
+    DMGTYPE_None,
+};
+
+static TArray<WORD> DamageTypeIDs;      // indexed by FName index
+static TArray<FName> DamageTypeNames;   // indexed by damage type ID
+
+int P_InternDamageType (FName type)
+{
+    if (DamageTypeNames.Size() == 0)
+    {
+        DamageTypeNames.Push (NAME_None);   // DMGTYPE_Unknown
+        DamageTypeNames.Push (NAME_None);   // DMGTYPE_None
+        DamageTypeIDs.Resize (NAME_None + 1);
+        memset (&DamageTypeIDs[0], 0, DamageTypeIDs.Size() * sizeof(WORD));
+        DamageTypeIDs[NAME_None] = DMGTYPE_None;
+    }
+
+    unsigned index = type.GetIndex();
+    if (index >= DamageTypeIDs.Size())
+    {
+        unsigned oldsize = DamageTypeIDs.Size();
+        DamageTypeIDs.Resize (index + 1);
+        memset (&DamageTypeIDs[oldsize], 0, (index + 1 - oldsize) * sizeof(WORD));
+    }
+    if (DamageTypeIDs[index] == DMGTYPE_Unknown)
+    {
+        assert (DamageTypeNames.Size() <= 0xFFFF);
+        DamageTypeIDs[index] = (WORD)DamageTypeNames.Push (type);
+    }
+    return DamageTypeIDs[index];
+}
+
+static inline int P_GetDamageTypeID (FName type)
+{
+    unsigned index = type.GetIndex();
+    return index < DamageTypeIDs.Size() ? DamageTypeIDs[index] : DMGTYPE_Unknown;
+}
+
+//==========================================================================
+//
+// FActorCombatInfo
+//
+// Per-class data for the damage and death path that only depends on the
+// class definition, with one FDamageTypeInfo per damage type ID. It is
+// built by FActorInfo::StaticBuildCombatInfo once all classes are final
+// and the damage type definitions have been read, so the hot path neither
+// searches state labels by name nor looks up damage types in maps. If a
+// class is asked for its combat info before that has happened, all of
+// them are built there and then.
+//
+//==========================================================================
+
+static void P_CollectLabelNames (FStateLabels *labels, TArray<FName> &names)
+{
+    if (labels == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < labels->NumLabels; ++i)
+    {
+        FName name = labels->Labels[i].Label;
+        if (name != NAME_None && names.Find (name) == names.Size())
+        {
+            names.Push (name);
+        }
+    }
+}
+
+void FActorInfo::CollectDamageTypes (TArray<FName> &types)
+{
+    static const FName typedlabels[] = { NAME_Death, NAME_Pain, NAME_Wound };
+
+    for (size_t i = 0; i < countof(typedlabels); ++i)
+    {
+        FStateLabel *label = StateList != NULL ? StateList->FindLabel (typedlabels[i]) : NULL;
+        if (label != NULL)
+        {
+            P_CollectLabelNames (label->Children, types);
+        }
+    }
+
+    FStateLabel *death = StateList != NULL ? StateList->FindLabel (NAME_Death) : NULL;
+    FStateLabel *extreme = (death != NULL && death->Children != NULL) ? death->Children->FindLabel (NAME_Extreme) : NULL;
+    if (extreme != NULL)
+    {
+        P_CollectLabelNames (extreme->Children, types);
+    }
+
+    if (PainChances != NULL)
+    {
+        TMapIterator<FName, int> it(*PainChances);
+        TMap<FName, int>::Pair *pair;
+        while (it.NextPair (pair))
+        {
+            if (types.Find (pair->Key) == types.Size()) types.Push (pair->Key);
+        }
+    }
+    if (DamageFactors != NULL)
+    {
+        TMapIterator<FName, fixed_t> it(*DamageFactors);
+        TMap<FName, fixed_t>::Pair *pair;
+        while (it.NextPair (pair))
+        {
+            if (types.Find (pair->Key) == types.Size()) types.Push (pair->Key);
+        }
+    }
+
+    // The damage this class deals, so its hits don't count as unknown.
+    FName dealt = GetDefaultByType (Class)->DamageType;
+    if (dealt != NAME_None && types.Find (dealt) == types.Size())
+    {
+        types.Push (dealt);
+    }
+}
+
+// Features of the loaded game data that let P_DamageMobj take a leaner
+// path when nothing uses them.
+static struct FDamageFeatures
+{
+    bool TypedFactors;      // some class scales some known damage type by other than 1
+} DamageFeatures = { true };
+
+static void P_ScanDamageFeatures ()
+{
+    DamageFeatures.TypedFactors = false;
+    for (unsigned i = 0; i < PClass::m_Types.Size() && !DamageFeatures.TypedFactors; ++i)
+    {
+        FActorInfo *info = PClass::m_Types[i]->ActorInfo;
+        if (info != NULL)
+        {
+            const TArray<FDamageTypeInfo> &types = info->CombatInfo.Types;
+            for (unsigned id = DMGTYPE_None; id < types.Size(); ++id)
+            {
+                if (types[id].Factor != FRACUNIT)
+                {
+                    DamageFeatures.TypedFactors = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void FActorInfo::StaticBuildCombatInfo ()
+{
+    static const FName builtintypes[] =
+    {
+        NAME_None, NAME_Fire, NAME_Ice, NAME_Extreme, NAME_Massacre,
+        NAME_Electric, NAME_PoisonCloud, NAME_Drowning, NAME_MDK, NAME_Telefrag,
+    };
+    TArray<FName> types;
+
+    for (size_t i = 0; i < countof(builtintypes); ++i)
+    {
+        P_InternDamageType (builtintypes[i]);
+    }
+    for (unsigned i = 0; i < PClass::m_Types.Size(); ++i)
+    {
+        FActorInfo *info = PClass::m_Types[i]->ActorInfo;
+        if (info != NULL)
+        {
+            types.Clear();
+            info->CollectDamageTypes (types);
+            for (unsigned j = 0; j < types.Size(); ++j)
+            {
+                P_InternDamageType (types[j]);
+            }
+        }
+    }
+    for (unsigned i = 0; i < PClass::m_Types.Size(); ++i)
+    {
+        FActorInfo *info = PClass::m_Types[i]->ActorInfo;
+        if (info != NULL)
+        {
+            info->BuildCombatInfo ();
+        }
+    }
+    P_ScanDamageFeatures ();
+}
+
+void FActorInfo::BuildCombatInfo ()
+{
+    FActorCombatInfo &combat = CombatInfo;
+
+    FName deathlabel = NAME_Death;
+    FName extremelabels[] = { NAME_Death, NAME_Extreme };
+    FState *extremestate = FindState (2, extremelabels, true);
+    FState *normalstate = FindState (1, &deathlabel);
+
+    combat.UntypedDeath.Resolved[false].State = normalstate;
+    combat.UntypedDeath.Resolved[false].Extreme = false;
+    combat.UntypedDeath.Resolved[true].State = extremestate != NULL ? extremestate : normalstate;
+    combat.UntypedDeath.Resolved[true].Extreme = extremestate != NULL;
+
+    FName freezelabel = NAME_GenericFreezeDeath;
+    combat.GenericFreezeDeath = FindState (1, &freezelabel);
+
+    // Class traits that AActor::Die and P_DamageMobj would otherwise fetch
+    // from the generic meta store or work out from the class hierarchy.
+    FName raiselabel = NAME_Raise;
+    combat.BurnHeight = Class->Meta.GetMetaFixed (AMETA_BurnHeight);
+    combat.DeathHeight = Class->Meta.GetMetaFixed (AMETA_DeathHeight);
+    combat.WoundHealth = Class->Meta.GetMetaInt (AMETA_WoundHealth, 6);
+    combat.HasRaiseState = FindState (1, &raiselabel) != NULL;
+    combat.CorpseEligible = combat.HasRaiseState || Class->IsDescendantOf (RUNTIME_CLASS(APlayerPawn));
+
+    combat.Types.Resize (DamageTypeNames.Size());
+    for (unsigned id = 0; id < DamageTypeNames.Size(); ++id)
+    {
+        BuildDamageTypeInfo (combat.Types[id], id == DMGTYPE_Unknown ? NAME_None : DamageTypeNames[id],
+            id == DMGTYPE_Unknown, combat.WoundHealth);
+    }
+}
+
+void FActorInfo::BuildDamageTypeInfo (FDamageTypeInfo &info, FName type, bool unknown, int woundhealth)
+{
+    int numlabels = type == NAME_None ? 1 : 2;
+
+    // Type specific deaths. A NULL state means "use the untyped death".
+    info.Death.Resolved[false].State = info.Death.Resolved[true].State = NULL;
+    info.Death.Resolved[false].Extreme = info.Death.Resolved[true].Extreme = false;
+    if (type != NAME_None)
+    {
+        FName extremelabels[] = { NAME_Death, NAME_Extreme, type };
+        FName normallabels[] = { NAME_Death, type };
+        FState *extremestate = FindState (3, extremelabels, true);
+        FState *normalstate = FindState (2, normallabels, true);
+
+        info.Death.Resolved[false].State = normalstate;
+        info.Death.Resolved[true].State = extremestate != NULL ? extremestate : normalstate;
+        info.Death.Resolved[true].Extreme = extremestate != NULL;
+    }
+
+    // Pain.<type> and Wound.<type> fall back to plain Pain and Wound.
+    FName woundlabels[] = { NAME_Wound, type };
+    FName painlabels[] = { NAME_Pain, type };
+    info.Pain.WoundState = FindState (numlabels, woundlabels);
+    info.Pain.PainState = FindState (numlabels, painlabels);
+    info.Pain.WoundHealth = woundhealth;
+
+    // PainChance "Normal" is stored under NAME_None and applies to untyped
+    // damage. A type that was never interned can't have a pain chance.
+    int *ppc = (PainChances != NULL && !unknown) ? PainChances->CheckKey (type) : NULL;
+    info.Pain.HasPainChance = ppc != NULL;
+    info.Pain.PainChance = ppc != NULL ? *ppc : 0;
+
+    // Every branch of ApplyMobjDamageFactor is a FixedMul by a value that
+    // only depends on the class and the type, so that value is worked out
+    // here the same way: the class's own factor for the type, else nothing
+    // for untyped damage, else the type's default factor, either replacing
+    // or scaling the class's untyped factor.
+    info.Factor = FRACUNIT;
+    if (!unknown)
+    {
+        fixed_t *pdf = DamageFactors != NULL ? DamageFactors->CheckKey (type) : NULL;
+        if (pdf != NULL)
+        {
+            info.Factor = *pdf;
+        }
+        else if (type != NAME_None)
+        {
+            fixed_t *pnf = DamageFactors != NULL ? DamageFactors->CheckKey (NAME_None) : NULL;
+            DamageTypeDefinition *dtd = DamageTypeDefinition::Get (type);
+
+            if (dtd == NULL)
+            {
+                info.Factor = pnf != NULL ? *pnf : FRACUNIT;
+            }
+            else if (pnf == NULL || dtd->ReplaceFactor)
+            {
+                info.Factor = dtd->DefaultFactor;
+            }
+            else
+            {
+                info.Factor = FixedMul (*pnf, dtd->DefaultFactor);
+            }
+        }
+    }
+}
+
+static inline const FActorCombatInfo &P_GetCombatInfo (const PClass *cls)
+{
+    if (cls->ActorInfo->CombatInfo.Types.Size() == 0)
+    {
+        FActorInfo::StaticBuildCombatInfo ();
+    }
+    return cls->ActorInfo->CombatInfo;
+}
+
+const FDamageTypeInfo &FActorCombatInfo::GetTypeInfo (FName type) const
+{
+    unsigned id = P_GetDamageTypeID (type);
+    return Types[id < Types.Size() ? id : DMGTYPE_Unknown];
+}
+
+static inline const FDamageTypeInfo &P_GetDamageTypeInfo (AActor *actor, FName type)
+{
+    return P_GetCombatInfo (actor->GetClass()).GetTypeInfo (type);
+}
+
+static inline const FPainInfo &P_GetPainInfo (AActor *actor, FName type)
+{
+    return P_GetDamageTypeInfo (actor, type).Pain;
+}
+
+//==========================================================================
+//
+// Damage trace
+//
+// A binary log of every P_DamageMobj call and every death, for finding
+// out where damage gets lost or amplified in a running game. Records go
+// into a fixed-size single-producer/single-consumer ring; a background
+// thread drains the ring into the trace file, so the game thread never
+// blocks on I/O. If the writer falls behind, records are dropped and the
+// number of dropped records is written to the file in their place.
+//
+// Use "dmgtrace start <file>" and "dmgtrace stop"; the dmgtrace tool in
+// Utils/DmgTrace decodes the file.
+//
+//==========================================================================
+
+enum EDamageTraceKind
+{
+    DTK_Damage,
+    DTK_Death,
+    DTK_Dropped,    // RawDamage holds the number of records lost
+};
+
+enum EDamageTraceStage
+{
+    DTS_Skill,
+    DTS_Special,
+    DTS_Multiply,
+    DTS_Protection,
+    DTS_Factor,
+    DTS_Armor,
+    DTS_TeamDamage,
+
+    DTS_NUM
+};
+
+enum EDamageTraceExit
+{
+    DTX_None,
+    DTX_Damaged,
+    DTX_Unshootable,
+    DTX_Spectral,
+    DTX_AlreadyDead,
+    DTX_Invulnerable,
+    DTX_Dormant,
+    DTX_Cancelled,      // something in the damage chain returned < 0
+    DTX_Nullified,      // damage reduced to 0
+    DTX_Friendly,
+    DTX_GodMode,
+    DTX_FakePain,
+    DTX_Pain,
+    DTX_Wound,
+    DTX_Death,
+    DTX_Buddha,
+
+    // DTK_Death records
+    DTX_DeathState,
+    DTX_DeathDestroyed,
+    DTX_DeathMissile,
+    DTX_DeathUnmorphed,
+    DTX_DeathMorphed,
+
+    DTX_NUM
+};
+
+static const char *const DamageExitNames[DTX_NUM] =
+{
+    "none", "damaged", "unshootable", "spectral", "alreadydead", "invulnerable",
+    "dormant", "cancelled", "nullified", "friendly", "godmode", "fakepain",
+    "pain", "wound", "death", "buddha",
+    "state", "destroyed", "missile", "unmorphed", "morphed",
+};
+
+enum { DTR_PREDICTING = 1 };
+
+enum { DTS_NOTREACHED = (int)0x80000000 };
+
+// Written to the file as is; keep in sync with Utils/DmgTrace.
+struct FDamageTraceRecord
+{
+    DWORD Tic;
+    BYTE Kind;
+    BYTE Exit;
+    BYTE Flags;
+    SBYTE TargetPlayer;
+    DWORD Target, Inflictor, Source;
+    WORD DamageType;
+    SWORD SourcePlayer;
+    SDWORD RawDamage;
+    SDWORD Stage[DTS_NUM];
+    SDWORD Result;
+    DWORD Pad;
+};
+
+class FDamageTrace
+{
+public:
+    enum { RING_SIZE = 1 << 15 };   // power of 2
+
+    FDamageTrace () : File(NULL), Ring(NULL), Head(0), Tail(0), Dropped(0), Running(false) {}
+    ~FDamageTrace () { Stop (); }     // quitting while tracing must not leave the writer joinable
+
+    bool IsActive () const
+    {
+        return Ring != NULL;
+    }
+
+    bool Start (const char *filename);
+    void Stop ();
+    void Push (const FDamageTraceRecord &rec);
+
+private:
+    void WriterThread ();
+    void Flush ();
+
+    FILE *File;
+    FDamageTraceRecord *Ring;
+    std::atomic<unsigned> Head;     // written by the game thread
+    std::atomic<unsigned> Tail;     // written by the writer thread
+    std::atomic<unsigned> Dropped;
+    std::atomic<bool> Running;
+    std::thread Writer;
+};
+
+static FDamageTrace DamageTrace;
+static FDamageTraceRecord *CurrentDamageTrace;
+static unsigned *DamageExitCounts;      // set by benchdamage to count exits instead of writing them
+
+bool FDamageTrace::Start (const char *filename)
+{
+    Stop ();
+    File = fopen (filename, "wb");
+    if (File == NULL)
+    {
+        return false;
+    }
+
+    // Header: magic, version, record size, then the damage type names so
+    // the decoder can print DamageType IDs.
+    DWORD header[4] = { MAKE_ID('D','M','G','T'), 1, sizeof(FDamageTraceRecord), DamageTypeNames.Size() };
+    fwrite (header, sizeof(header), 1, File);
+    for (unsigned i = 0; i < DamageTypeNames.Size(); ++i)
+    {
+        const char *name = i == DMGTYPE_Unknown ? "?" : DamageTypeNames[i].GetChars();
+        fwrite (name, strlen(name) + 1, 1, File);
+    }
+
+    TraceActorIDs.Clear();
+    NextTraceActorID = 0;
+    Ring = new FDamageTraceRecord[RING_SIZE];
+    Head = Tail = Dropped = 0;
+    Running = true;
+    Writer = std::thread (&FDamageTrace::WriterThread, this);
+    return true;
+}
+
+void FDamageTrace::Stop ()
+{
+    if (Ring == NULL)
+    {
+        return;
+    }
+    Running = false;
+    Writer.join ();
+    Flush ();
+    fclose (File);
+    File = NULL;
+    delete[] Ring;
+    Ring = NULL;
+}
+
+void FDamageTrace::Push (const FDamageTraceRecord &rec)
+{
+    unsigned head = Head.load (std::memory_order_relaxed);
+    if (head - Tail.load (std::memory_order_acquire) >= RING_SIZE)
+    {
+        Dropped.fetch_add (1, std::memory_order_relaxed);
+        return;
+    }
+    Ring[head & (RING_SIZE - 1)] = rec;
+    Head.store (head + 1, std::memory_order_release);
+}
+
+void FDamageTrace::Flush ()
+{
+    unsigned tail = Tail.load (std::memory_order_relaxed);
+    unsigned head = Head.load (std::memory_order_acquire);
+
+    while (tail != head)
+    {
+        unsigned start = tail & (RING_SIZE - 1);
+        unsigned count = MIN<unsigned> (head - tail, RING_SIZE - start);
+        fwrite (&Ring[start], sizeof(FDamageTraceRecord), count, File);
+        tail += count;
+    }
+    Tail.store (tail, std::memory_order_release);
+
+    unsigned dropped = Dropped.exchange (0, std::memory_order_relaxed);
+    if (dropped != 0)
+    {
+        FDamageTraceRecord rec;
+        memset (&rec, 0, sizeof(rec));
+        rec.Kind = DTK_Dropped;
+        rec.RawDamage = dropped;
+        fwrite (&rec, sizeof(rec), 1, File);
+    }
+}
+
+void FDamageTrace::WriterThread ()
+{
+    while (Running.load (std::memory_order_acquire))
+    {
+        Flush ();
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+    }
+}
+
+// Actors are numbered in the order a trace first sees them, starting
+// over with each trace, so IDs never collide the way truncated addresses
+// do on 64-bit builds. Nothing tells the trace when an actor is freed,
+// so a new actor that gets the memory of a freed one inherits its ID.
+static TMap<AActor *, DWORD> TraceActorIDs;
+static DWORD NextTraceActorID;
+
+static DWORD P_TraceActorID (AActor *actor)
+{
+    if (actor == NULL)
+    {
+        return 0;
+    }
+    DWORD *id = TraceActorIDs.CheckKey (actor);
+    if (id == NULL)
+    {
+        id = &TraceActorIDs.Insert (actor, ++NextTraceActorID);
+    }
+    return *id;
+}
+
+static void P_InitTraceRecord (FDamageTraceRecord &rec, int kind, AActor *target, AActor *inflictor, AActor *source, FName mod)
+{
+    memset (&rec, 0, sizeof(rec));
+    rec.Tic = gametic;
+    rec.Kind = (BYTE)kind;
+    rec.Target = P_TraceActorID (target);
+    rec.Inflictor = P_TraceActorID (inflictor);
+    rec.Source = P_TraceActorID (source);
+    rec.TargetPlayer = (target != NULL && target->player != NULL) ? SBYTE(target->player - players) : -1;
+    rec.SourcePlayer = (source != NULL && source->player != NULL) ? SWORD(source->player - players) : -1;
+    rec.DamageType = (WORD)P_GetDamageTypeID (mod);
+    if (target != NULL && target->player != NULL && (target->player->cheats & CF_PREDICTING))
+    {
+        rec.Flags |= DTR_PREDICTING;
+    }
+    for (int i = 0; i < DTS_NUM; ++i)
+    {
+        rec.Stage[i] = DTS_NOTREACHED;
+    }
+}
+
+static void P_TraceDeath (AActor *self, AActor *source, AActor *inflictor, int exit)
+{
+    if (DamageExitCounts != NULL)
+    {
+        DamageExitCounts[exit]++;
+    }
+    if (DamageTrace.IsActive ())
+    {
+        FDamageTraceRecord rec;
+        P_InitTraceRecord (rec, DTK_Death, self, inflictor, source, self->DamageType);
+        rec.Exit = (BYTE)exit;
+        rec.RawDamage = self->health;
+        rec.Result = self->health;
+        DamageTrace.Push (rec);
+    }
+}
+
+#define DMGTRACE_STAGE(stage, value) \
+    do { if (CurrentDamageTrace != NULL) CurrentDamageTrace->Stage[stage] = (value); } while (0)
+#define DMGTRACE_EXIT(exit) \
+    do { if (CurrentDamageTrace != NULL) CurrentDamageTrace->Exit = (exit); } while (0)
+
+CCMD (dmgtrace)
+{
+    if (argv.argc() >= 3 && !stricmp (argv[1], "start"))
+    {
+        if (DamageTrace.Start (argv[2]))
+        {
+            Printf ("Tracing damage to %s\n", argv[2]);
+        }
+        else
+        {
+            Printf ("Could not open %s\n", argv[2]);
+        }
+    }
+    else if (argv.argc() >= 2 && !stricmp (argv[1], "stop"))
+    {
+        DamageTrace.Stop ();
+    }
+    else
+    {
+        Printf ("Usage: dmgtrace start <file> | stop\n");
+    }
+}
+
+//==========================================================================
+//
+// Combat snapshots
+//
+// Lets client prediction run P_DamageMobj and AActor::Die speculatively
+// and undo them. While a snapshot is active, each actor the damage path
+// is about to change is saved the first time it is touched, together
+// with its player and the items it carries. The random number generators
+// of the damage path are saved when the snapshot starts. Rollback puts
+// all of it back.
+//
+// What is saved is the actor and player fields listed below, which
+// include the visible state and the poison the base DoSpecialDamage
+// hands out, the amount and flags of every item, the full state of basic
+// and Hexen armor and the duration of powerups. While captured, items are
+// flagged IF_KEEPDEPLETED, so armor that runs out and auto-uses another
+// armor item leaves that item in the inventory for Rollback to restore
+// instead of destroying it. Anything else a class's own DoSpecialDamage,
+// TakeSpecialDamage or item overrides change is not covered.
+//
+// Predicted damage and deaths leave out everything that could not be
+// rolled back or must not be seen or heard: presentation events, scripts
+// and specials, state actions and howls, weapon drops, notifying, giving
+// or auto-using items, unmorphing, ending the level, exploding missiles
+// and destroying actors. "benchdamage predict" checks the round trip.
+//
+//==========================================================================
+
+#define COMBAT_ACTOR_FIELDS(X) \
+    X(health) X(flags) X(flags2) X(flags3) X(flags4) X(flags5) X(flags6) X(flags7) \
+    X(state) X(tics) X(sprite) X(frame) X(velx) X(vely) X(velz) X(height) X(target) X(lastenemy) \
+    X(threshold) X(reactiontime) X(DamageType) X(DamageTypeReceived) X(special1) \
+    X(special) X(alpha) X(visdir) X(renderflags) X(effects) X(PoisonDamageReceived) \
+    X(PoisonDurationReceived) X(PoisonPeriodReceived) X(PoisonDamageTypeReceived) X(Poisoner)
+
+#define COMBAT_PLAYER_FIELDS(X) \
+    X(health) X(damagecount) X(attacker) X(LastDamageType) X(playerstate) \
+    X(respawn_time) X(extralight) X(cheats) X(fragcount) X(spreecount) \
+    X(multicount) X(killcount) X(lastkilltime) X(poisoncount) X(poisoner) X(poisontype) \
+    X(poisonpaintype)
+
+#define DECLARE_COMBAT_FIELD(f)     decltype(Owner->f) f;
+#define SAVE_COMBAT_FIELD(f)        f = Owner->f;
+#define RESTORE_COMBAT_FIELD(f)     Owner->f = f;
+
+struct FCombatActorState
+{
+    AActor *Owner;
+    COMBAT_ACTOR_FIELDS(DECLARE_COMBAT_FIELD)
+
+    void Save () { COMBAT_ACTOR_FIELDS(SAVE_COMBAT_FIELD) }
+    void Restore () { COMBAT_ACTOR_FIELDS(RESTORE_COMBAT_FIELD) }
+};
+
+struct FCombatPlayerState
+{
+    player_t *Owner;
+    COMBAT_PLAYER_FIELDS(DECLARE_COMBAT_FIELD)
+    int frags[MAXPLAYERS];
+
+    void Save () { COMBAT_PLAYER_FIELDS(SAVE_COMBAT_FIELD) memcpy (frags, Owner->frags, sizeof(frags)); }
+    void Restore () { COMBAT_PLAYER_FIELDS(RESTORE_COMBAT_FIELD) memcpy (Owner->frags, frags, sizeof(frags)); }
+};
+
+#define COMBAT_ITEM_FIELDS(X) \
+    X(Amount) X(MaxAmount) X(ItemFlags) X(Icon)
+
+#define COMBAT_BASICARMOR_FIELDS(X) \
+    X(SavePercent) X(MaxAbsorb) X(MaxFullAbsorb) X(BonusCount) X(ArmorType) X(AbsorbCount)
+
+#define COMBAT_HEXENARMOR_FIELDS(X) \
+    X(Slots) X(SlotsIncrement)
+
+#define COMBAT_POWERUP_FIELDS(X) \
+    X(EffectTics)
+
+struct FCombatItemState
+{
+    AInventory *Owner;
+    COMBAT_ITEM_FIELDS(DECLARE_COMBAT_FIELD)
+
+    void Save () { COMBAT_ITEM_FIELDS(SAVE_COMBAT_FIELD) }
+    void Restore () { COMBAT_ITEM_FIELDS(RESTORE_COMBAT_FIELD) }
+};
+
+struct FCombatBasicArmorState
+{
+    ABasicArmor *Owner;
+    COMBAT_BASICARMOR_FIELDS(DECLARE_COMBAT_FIELD)
+
+    void Save () { COMBAT_BASICARMOR_FIELDS(SAVE_COMBAT_FIELD) }
+    void Restore () { COMBAT_BASICARMOR_FIELDS(RESTORE_COMBAT_FIELD) }
+};
+
+// The slots are arrays, so they are copied rather than assigned.
+#define DECLARE_COMBAT_ARRAY(f)     decltype(Owner->f) f;
+#define SAVE_COMBAT_ARRAY(f)        memcpy (f, Owner->f, sizeof(f));
+#define RESTORE_COMBAT_ARRAY(f)     memcpy (Owner->f, f, sizeof(f));
+
+struct FCombatHexenArmorState
+{
+    AHexenArmor *Owner;
+    COMBAT_HEXENARMOR_FIELDS(DECLARE_COMBAT_ARRAY)
+
+    void Save () { COMBAT_HEXENARMOR_FIELDS(SAVE_COMBAT_ARRAY) }
+    void Restore () { COMBAT_HEXENARMOR_FIELDS(RESTORE_COMBAT_ARRAY) }
+};
+
+#undef DECLARE_COMBAT_ARRAY
+#undef SAVE_COMBAT_ARRAY
+#undef RESTORE_COMBAT_ARRAY
+
+struct FCombatPowerupState
+{
+    APowerup *Owner;
+    COMBAT_POWERUP_FIELDS(DECLARE_COMBAT_FIELD)
+
+    void Save () { COMBAT_POWERUP_FIELDS(SAVE_COMBAT_FIELD) }
+    void Restore () { COMBAT_POWERUP_FIELDS(RESTORE_COMBAT_FIELD) }
+};
+
+#undef DECLARE_COMBAT_FIELD
+#undef SAVE_COMBAT_FIELD
+#undef RESTORE_COMBAT_FIELD
+
+//==========================================================================
+//
+// FCombatRandomState
+//
+// The state of the random number streams the damage and death path draws
+// from, saved and restored as a whole. Each generator is copied with
+// FRandom's own copy operations, which also copy its name and its link in
+// the RNG list; those never change while the program runs, since every
+// FRandom is created and destroyed with it, so writing a copy back only
+// changes the generator state and index. Restoring it replays exactly
+// the same numbers.
+//
+//==========================================================================
+
+static FRandom *const CombatRandoms[] =
+{
+    &pr_damagemobj, &pr_kickbackdir, &pr_killmobj, &pr_lightning, &pr_poison, &pr_botrespawn,
+};
+
+class FCombatRandomState
+{
+public:
+    // The copies are made up front, so saving doesn't allocate. They are
+    // not linked into the RNG list; destroying them leaves it alone.
+    FCombatRandomState ()
+    {
+        for (size_t i = 0; i < countof(CombatRandoms); ++i)
+        {
+            Saved[i] = new FRandom (*CombatRandoms[i]);
+        }
+    }
+    ~FCombatRandomState ()
+    {
+        for (size_t i = 0; i < countof(CombatRandoms); ++i)
+        {
+            delete Saved[i];
+        }
+    }
+
+    void Save ()
+    {
+        for (size_t i = 0; i < countof(CombatRandoms); ++i)
+        {
+            *Saved[i] = *CombatRandoms[i];
+        }
+    }
+    void Restore () const
+    {
+        for (size_t i = 0; i < countof(CombatRandoms); ++i)
+        {
+            *CombatRandoms[i] = *Saved[i];
+        }
+    }
+
+private:
+    FCombatRandomState (const FCombatRandomState &);
+    FCombatRandomState &operator= (const FCombatRandomState &);
+
+    FRandom *Saved[countof(CombatRandoms)];
+};
+
+class FCombatSnapshot
+{
+public:
+    void Begin ();
+    void Capture (AActor *actor);
+    void Rollback ();
+
+private:
+    void CapturePlayer (player_t *player);
+    void CaptureItem (AInventory *item);
+
+    TArray<FCombatActorState> Actors;
+    TMap<AActor *, bool> CapturedActors;
+    TArray<FCombatPlayerState> Players;
+    TArray<FCombatItemState> Items;
+    TArray<FCombatBasicArmorState> BasicArmors;
+    TArray<FCombatHexenArmorState> HexenArmors;
+    TArray<FCombatPowerupState> Powerups;
+    int KilledMonsters;
+    FCombatRandomState Randoms;
+};
+
+static FCombatSnapshot *CombatSnapshot;     // the active one, if any
+
+static inline bool P_PredictingCombat ()
+{
+    return CombatSnapshot != NULL;
+}
+
+// Saves an actor unless the active snapshot already has it.
+static inline void P_CaptureCombatActor (AActor *actor)
+{
+    if (CombatSnapshot != NULL && actor != NULL)
+    {
+        CombatSnapshot->Capture (actor);
+    }
+}
+
+void FCombatSnapshot::Begin ()
+{
+    assert (CombatSnapshot == NULL);
+    Actors.Clear();
+    CapturedActors.Clear();
+    Players.Clear();
+    Items.Clear();
+    BasicArmors.Clear();
+    HexenArmors.Clear();
+    Powerups.Clear();
+    KilledMonsters = level.killed_monsters;
+    Randoms.Save ();
+    CombatSnapshot = this;
+}
+
+void FCombatSnapshot::Capture (AActor *actor)
+{
+    if (CapturedActors.CheckKey (actor) != NULL)
+    {
+        return;
+    }
+    CapturedActors[actor] = true;
+
+    FCombatActorState &st = Actors[Actors.Reserve (1)];
+    st.Owner = actor;
+    st.Save ();
+    for (AInventory *item = actor->Inventory; item != NULL; item = item->Inventory)
+    {
+        CaptureItem (item);
+    }
+    if (actor->player != NULL)
+    {
+        CapturePlayer (actor->player);
+        if (actor->player->mo != NULL && actor->player->mo != actor)
+        {
+            Capture (actor->player->mo);    // hit a voodoo doll
+        }
+    }
+}
+
+void FCombatSnapshot::CaptureItem (AInventory *item)
+{
+    FCombatItemState &st = Items[Items.Reserve (1)];
+    st.Owner = item;
+    st.Save ();
+
+    if (item->IsKindOf (RUNTIME_CLASS(ABasicArmor)))
+    {
+        FCombatBasicArmorState &armor = BasicArmors[BasicArmors.Reserve (1)];
+        armor.Owner = static_cast<ABasicArmor *>(item);
+        armor.Save ();
+    }
+    else if (item->IsKindOf (RUNTIME_CLASS(AHexenArmor)))
+    {
+        FCombatHexenArmorState &armor = HexenArmors[HexenArmors.Reserve (1)];
+        armor.Owner = static_cast<AHexenArmor *>(item);
+        armor.Save ();
+    }
+    else if (item->IsKindOf (RUNTIME_CLASS(APowerup)))
+    {
+        FCombatPowerupState &power = Powerups[Powerups.Reserve (1)];
+        power.Owner = static_cast<APowerup *>(item);
+        power.Save ();
+    }
+
+    // Used up items stay where Rollback can find them.
+    item->ItemFlags |= IF_KEEPDEPLETED;
+}
+
+void FCombatSnapshot::CapturePlayer (player_t *player)
+{
+    for (unsigned i = 0; i < Players.Size(); ++i)
+    {
+        if (Players[i].Owner == player)
+        {
+            return;
+        }
+    }
+
+    FCombatPlayerState &st = Players[Players.Reserve (1)];
+    st.Owner = player;
+    st.Save ();
+}
+
+void FCombatSnapshot::Rollback ()
+{
+    assert (CombatSnapshot == this);
+
+    // Newest first, in case something got saved twice after all.
+    for (unsigned i = Powerups.Size(); i-- > 0; )
+    {
+        Powerups[i].Restore ();
+    }
+    for (unsigned i = HexenArmors.Size(); i-- > 0; )
+    {
+        HexenArmors[i].Restore ();
+    }
+    for (unsigned i = BasicArmors.Size(); i-- > 0; )
+    {
+        BasicArmors[i].Restore ();
+    }
+    for (unsigned i = Items.Size(); i-- > 0; )
+    {
+        Items[i].Restore ();
+    }
+    for (unsigned i = Players.Size(); i-- > 0; )
+    {
+        Players[i].Restore ();
+    }
+    for (unsigned i = Actors.Size(); i-- > 0; )
+    {
+        Actors[i].Restore ();
+        Actors[i].Owner->InvalidateInventoryIndex ();
+    }
+    level.killed_monsters = KilledMonsters;
+    Randoms.Restore ();
+    CombatSnapshot = NULL;
+}
+
+//==========================================================================
+//
+// Match telemetry
+//
+// Streams what happens in a match as newline-delimited JSON, for live
+// dashboards on servers: one line per tic in which something changed,
+// with the change in the kill and frag counters and the damage dealt per
+// damage type in that tic. The first line lists the damage type names.
+//
+// The game thread only compares a few counters with their previous values
+// and appends small fixed-size entries; a background thread turns them
+// into text and writes them out, so the simulation never waits for the
+// file. The file can be a named pipe to feed a collector directly.
+//
+// Tics are closed by a DTelemetryTicker thinker, which runs while
+// telemetry is on and is started again by the next damage or death after
+// a level change. Use "telemetry start <file>" and "telemetry stop".
+//
+//==========================================================================
+
+enum ETelemetryKind
+{
+    TEL_KilledMonsters,
+    TEL_KillCount,
+    TEL_FragCount,
+    TEL_SpreeCount,
+    TEL_MultiCount,
+    TEL_LastKillTime,   // absolute, not a change
+    TEL_Frags,          // Index is the fragged player
+    TEL_Damage,         // Index is the damage type ID
+
+    TEL_NUM
+};
+
+static const char *const TelemetryKindNames[TEL_NUM] =
+{
+    "killed_monsters", "killcount", "fragcount", "spreecount", "multicount", "lastkilltime", "frags", "damage",
+};
+
+struct FTelemetryEntry
+{
+    DWORD Tic;
+    BYTE Kind;
+    BYTE Player;
+    WORD Index;
+    SDWORD Value;
+};
+
+class FMatchTelemetry
+{
+public:
+    FMatchTelemetry () : File(NULL), Running(false), Tic(0) {}
+    ~FMatchTelemetry () { Close (); }
+
+    bool IsActive () const
+    {
+        return File != NULL;
+    }
+
+    bool Start (const char *filename);
+    void Stop ();
+    void Update ();
+    void AddDamage (int type, int damage);
+
+private:
+    struct FCounters
+    {
+        int KillCount, FragCount, SpreeCount, MultiCount, LastKillTime;
+        int Frags[MAXPLAYERS];
+    };
+
+    void Sample (bool emit);
+    void CloseTic ();
+    void Emit (int kind, int player, int index, int value);
+    void WriterThread ();
+    void Flush ();
+    void Close ();
+
+    FILE *File;
+    std::atomic<bool> Running;
+    std::thread Writer;
+    std::mutex Lock;
+    TArray<FTelemetryEntry> Queue;      // guarded by Lock
+
+    // Game thread only
+    int Tic;
+    TArray<FTelemetryEntry> Pending;
+    TArray<int> TicDamage;              // by damage type ID
+    FCounters Last[MAXPLAYERS];
+    int LastKilledMonsters;
+
+    // Writer thread only, apart from Start
+    TArray<FTelemetryEntry> Batch;
+    TArray<FString> TypeNames;          // already escaped for JSON
+};
+
+static FMatchTelemetry MatchTelemetry;
+
+// Closes quiet tics for MatchTelemetry. Thinkers don't survive a level
+// change, so Update starts a new one whenever it finds none.
+class DTelemetryTicker : public DThinker
+{
+    DECLARE_CLASS (DTelemetryTicker, DThinker)
+public:
+    DTelemetryTicker ();
+    void Tick ();
+    void Destroy ();
+};
+
+IMPLEMENT_CLASS (DTelemetryTicker)
+
+static DTelemetryTicker *TelemetryTicker;
+
+DTelemetryTicker::DTelemetryTicker ()
+{
+    TelemetryTicker = this;
+}
+
+void DTelemetryTicker::Tick ()
+{
+    // One restored from a savegame takes over if telemetry is running.
+    if (!MatchTelemetry.IsActive () || (TelemetryTicker != NULL && TelemetryTicker != this))
+    {
+        Destroy ();
+        return;
+    }
+    TelemetryTicker = this;
+    MatchTelemetry.Update ();
+}
+
+void DTelemetryTicker::Destroy ()
+{
+    if (TelemetryTicker == this)
+    {
+        TelemetryTicker = NULL;
+    }
+    Super::Destroy ();
+}
+
+static FString P_EscapeJSON (const char *str)
+{
+    FString out;
+    for (; *str != 0; ++str)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            out += '\\';
+        }
+        out += *str;
+    }
+    return out;
+}
+
+bool FMatchTelemetry::Start (const char *filename)
+{
+    Stop ();
+    File = fopen (filename, "w");
+    if (File == NULL)
+    {
+        return false;
+    }
+
+    TypeNames.Clear();
+    fputs ("{\"types\":[", File);
+    for (unsigned i = 0; i < DamageTypeNames.Size(); ++i)
+    {
+        TypeNames.Push (i == DMGTYPE_Unknown ? FString("?") : P_EscapeJSON (DamageTypeNames[i].GetChars()));
+        fprintf (File, "%s\"%s\"", i ? "," : "", TypeNames[i].GetChars());
+    }
+    fputs ("]}\n", File);
+    fflush (File);
+
+    TicDamage.Resize (DamageTypeNames.Size());
+    memset (&TicDamage[0], 0, TicDamage.Size() * sizeof(int));
+    Pending.Clear();
+    Queue.Clear();
+    Tic = gametic;
+    Sample (false);
+
+    Running = true;
+    Writer = std::thread (&FMatchTelemetry::WriterThread, this);
+    if (TelemetryTicker == NULL)
+    {
+        new DTelemetryTicker;
+    }
+    return true;
+}
+
+void FMatchTelemetry::Stop ()
+{
+    if (File == NULL)
+    {
+        return;
+    }
+    CloseTic ();
+    Close ();
+}
+
+// Also used at exit, where the game state may already be gone, so this
+// only hands over what was already queued.
+void FMatchTelemetry::Close ()
+{
+    if (File == NULL)
+    {
+        return;
+    }
+    Running = false;
+    Writer.join ();
+    Flush ();
+    fclose (File);
+    File = NULL;
+}
+
+void FMatchTelemetry::Emit (int kind, int player, int index, int value)
+{
+    FTelemetryEntry entry = { DWORD(Tic), BYTE(kind), BYTE(player), WORD(index), value };
+    Pending.Push (entry);
+}
+
+// Compares the counters with the last sample and, if emit is set, records
+// the changes for the current tic.
+void FMatchTelemetry::Sample (bool emit)
+{
+    if (emit && level.killed_monsters != LastKilledMonsters)
+    {
+        Emit (TEL_KilledMonsters, 0, 0, level.killed_monsters - LastKilledMonsters);
+    }
+    LastKilledMonsters = level.killed_monsters;
+
+    // Players not in the game are sampled too, so a player who joins
+    // starts from their current counters.
+    for (int i = 0; i < MAXPLAYERS; ++i)
+    {
+        const player_t *player = &players[i];
+        FCounters &last = Last[i];
+
+        if (emit && playeringame[i])
+        {
+            if (player->killcount != last.KillCount) Emit (TEL_KillCount, i, 0, player->killcount - last.KillCount);
+            if (player->fragcount != last.FragCount) Emit (TEL_FragCount, i, 0, player->fragcount - last.FragCount);
+            if (player->spreecount != last.SpreeCount) Emit (TEL_SpreeCount, i, 0, player->spreecount - last.SpreeCount);
+            if (player->multicount != last.MultiCount) Emit (TEL_MultiCount, i, 0, player->multicount - last.MultiCount);
+            if (player->lastkilltime != last.LastKillTime) Emit (TEL_LastKillTime, i, 0, player->lastkilltime);
+            for (int j = 0; j < MAXPLAYERS; ++j)
+            {
+                if (player->frags[j] != last.Frags[j]) Emit (TEL_Frags, i, j, player->frags[j] - last.Frags[j]);
+            }
+        }
+        last.KillCount = player->killcount;
+        last.FragCount = player->fragcount;
+        last.SpreeCount = player->spreecount;
+        last.MultiCount = player->multicount;
+        last.LastKillTime = player->lastkilltime;
+        memcpy (last.Frags, player->frags, sizeof(last.Frags));
+    }
+}
+
+// Closes the tic everything so far belongs to once the game has moved on.
+void FMatchTelemetry::Update ()
+{
+    if (File == NULL)
+    {
+        return;
+    }
+    if (Tic != gametic)
+    {
+        CloseTic ();
+    }
+    if (TelemetryTicker == NULL)
+    {
+        new DTelemetryTicker;
+    }
+}
+
+void FMatchTelemetry::CloseTic ()
+{
+    Sample (true);
+    for (unsigned i = 0; i < TicDamage.Size(); ++i)
+    {
+        if (TicDamage[i] != 0)
+        {
+            Emit (TEL_Damage, 0, i, TicDamage[i]);
+            TicDamage[i] = 0;
+        }
+    }
+    if (Pending.Size() > 0)
+    {
+        std::lock_guard<std::mutex> lock (Lock);
+        for (unsigned i = 0; i < Pending.Size(); ++i)
+        {
+            Queue.Push (Pending[i]);
+        }
+    }
+    Pending.Clear();
+    Tic = gametic;
+}
+
+void FMatchTelemetry::AddDamage (int type, int damage)
+{
+    Update ();
+    if ((unsigned)type < TicDamage.Size())
+    {
+        TicDamage[type] += damage;
+    }
+}
+
+void FMatchTelemetry::Flush ()
+{
+    {
+        std::lock_guard<std::mutex> lock (Lock);
+        Batch.Clear();
+        for (unsigned i = 0; i < Queue.Size(); ++i)
+        {
+            Batch.Push (Queue[i]);
+        }
+        Queue.Clear();
+    }
+
+    // Entries come grouped by tic: the monster count first, then each
+    // player's counters with their frags last, then the damage totals.
+    // {"tic":N,"killed_monsters":1,"players":{"0":{"killcount":1,"frags":{"3":1}}},"damage":{"Fire":20}}
+    for (unsigned i = 0; i < Batch.Size(); )
+    {
+        DWORD tic = Batch[i].Tic;
+        int player = -1;        // player object currently open
+        bool first = false;     // nothing written into it yet
+        bool frags = false;     // its frags object is open
+        bool damage = false;    // the damage object is open
+
+        fprintf (File, "{\"tic\":%u", tic);
+        for (; i < Batch.Size() && Batch[i].Tic == tic; ++i)
+        {
+            const FTelemetryEntry &e = Batch[i];
+
+            if (e.Kind == TEL_KilledMonsters)
+            {
+                fprintf (File, ",\"%s\":%d", TelemetryKindNames[e.Kind], e.Value);
+            }
+            else if (e.Kind == TEL_Damage)
+            {
+                if (frags) fputs ("}", File);
+                if (player >= 0) fputs ("}}", File);
+                frags = false;
+                player = -1;
+                fprintf (File, "%s\"%s\":%d", damage ? "," : ",\"damage\":{",
+                    e.Index < TypeNames.Size() ? TypeNames[e.Index].GetChars() : "?", e.Value);
+                damage = true;
+            }
+            else
+            {
+                if (e.Player != player)
+                {
+                    if (frags) fputs ("}", File);
+                    frags = false;
+                    fprintf (File, "%s\"%d\":{", player >= 0 ? "}," : ",\"players\":{", e.Player);
+                    player = e.Player;
+                    first = true;
+                }
+                if (e.Kind == TEL_Frags)
+                {
+                    fprintf (File, "%s\"%d\":%d", frags ? "," : first ? "\"frags\":{" : ",\"frags\":{", e.Index, e.Value);
+                    frags = true;
+                }
+                else
+                {
+                    fprintf (File, "%s\"%s\":%d", first ? "" : ",", TelemetryKindNames[e.Kind], e.Value);
+                }
+                first = false;
+            }
+        }
+        if (frags) fputs ("}", File);
+        if (player >= 0) fputs ("}}", File);
+        if (damage) fputs ("}", File);
+        fputs ("}\n", File);
+    }
+    fflush (File);
+}
+
+void FMatchTelemetry::WriterThread ()
+{
+    while (Running.load (std::memory_order_acquire))
+    {
+        Flush ();
+        std::this_thread::sleep_for (std::chrono::milliseconds(50));
+    }
+}
+
+CCMD (telemetry)
+{
+    if (argv.argc() >= 3 && !stricmp (argv[1], "start"))
+    {
+        if (MatchTelemetry.Start (argv[2]))
+        {
+            Printf ("Writing match telemetry to %s\n", argv[2]);
+        }
+        else
+        {
+            Printf ("Could not open %s\n", argv[2]);
+        }
+    }
+    else if (argv.argc() >= 2 && !stricmp (argv[1], "stop"))
+    {
+        MatchTelemetry.Stop ();
+    }
+    else
+    {
+        Printf ("Usage: telemetry start <file> | stop\n");
+    }
+}
+
+//==========================================================================
+//
+// Message templates
+//
+// The spree, multikill and frag limit messages are string table entries
+// with %o, %k, %g, %h and %p standing for the victim's and killer's names
+// and the victim's pronouns. P_CompileMessageTemplates looks them up and
+// compiles each into a list of tokens when the language is loaded, so
+// showing one is a single pass over its tokens into the caller's buffer,
+// with no string table lookup and no placeholder scan. The result is the
+// same as SexMessage's, but never longer than the buffer it is given.
+//
+// The compiled templates remember the language they were compiled for,
+// and the next message after the language changes compiles them again.
+//
+//==========================================================================
+
+enum EMessageToken
+{
+    MTOK_Text,          // Length characters of the source, starting at Offset
+    MTOK_Pronoun,       // Arg is 0 for he, 1 for him, 2 for his
+    MTOK_Victim,
+    MTOK_Killer,
+};
+
+struct FMessageToken
+{
+    BYTE Type;
+    BYTE Arg;
+    WORD Length;
+    unsigned Offset;
+};
+
+struct FMessageTemplate
+{
+    FString Source;
+    TArray<FMessageToken> Tokens;
+
+    void Compile (const char *text);
+    int Format (char *to, int size, int gender, const char *victim, const char *killer) const;
+};
+
+static const char *const MessagePronouns[3][3] =
+{
+    { "he",  "him", "his" },
+    { "she", "her", "her" },
+    { "it",  "it",  "its" }
+};
+
+void FMessageTemplate::Compile (const char *text)
+{
+    Source = text != NULL ? text : "";
+    Tokens.Clear();
+
+    const char *from = Source.GetChars();
+    const char *start = from;
+    for (;;)
+    {
+        const char *lit = from;
+        while (*from != 0 && (from[0] != '%' || strchr ("ghpok", from[1]) == NULL || from[1] == 0))
+        {
+            from++;
+        }
+        if (from > lit)
+        {
+            FMessageToken tok = { MTOK_Text, 0, WORD(from - lit), unsigned(lit - start) };
+            Tokens.Push (tok);
+        }
+        if (*from == 0)
+        {
+            break;
+        }
+
+        FMessageToken tok = { MTOK_Pronoun, 0, 0, 0 };
+        switch (from[1])
+        {
+        case 'g':   tok.Arg = 0;    break;
+        case 'h':   tok.Arg = 1;    break;
+        case 'p':   tok.Arg = 2;    break;
+        case 'o':   tok.Type = MTOK_Victim; break;
+        case 'k':   tok.Type = MTOK_Killer; break;
+        }
+        Tokens.Push (tok);
+        from += 2;
+    }
+}
+
+// Returns the length of the message, which is always NUL terminated.
+int FMessageTemplate::Format (char *to, int size, int gender, const char *victim, const char *killer) const
+{
+    const char *source = Source.GetChars();
+    int len = 0;
+
+    if (gender < 0 || gender > 2)
+    {
+        gender = 2;
+    }
+    for (unsigned i = 0; i < Tokens.Size() && len < size - 1; ++i)
+    {
+        const FMessageToken &tok = Tokens[i];
+        const char *text;
+        int count;
+
+        switch (tok.Type)
+        {
+        case MTOK_Text:     text = source + tok.Offset; count = tok.Length;  break;
+        case MTOK_Pronoun:  text = MessagePronouns[gender][tok.Arg]; count = (int)strlen (text);  break;
+        case MTOK_Victim:   text = victim; count = (int)strlen (text);  break;
+        default:            text = killer; count = (int)strlen (text);  break;
+        }
+        if (count > size - 1 - len)
+        {
+            count = size - 1 - len;
+        }
+        memcpy (to + len, text, count);
+        len += count;
+    }
+    to[len] = 0;
+    return len;
+}
+
+enum EKillMessage
+{
+    KMSG_None = -1,
+    KMSG_SpreeKillSelf,
+    KMSG_Spree5,
+    KMSG_Spree10,
+    KMSG_Spree15,
+    KMSG_Spree20,
+    KMSG_Spree25,
+    KMSG_SpreeOver,
+    KMSG_Multi2,
+    KMSG_Multi3,
+    KMSG_Multi4,
+    KMSG_Multi5,
+    KMSG_FragLimit,
+
+    NUM_KILLMESSAGES
+};
+
+static const char *const KillMessageNames[NUM_KILLMESSAGES] =
+{
+    "SPREEKILLSELF", "SPREE5", "SPREE10", "SPREE15", "SPREE20", "SPREE25", "SPREEOVER",
+    "MULTI2", "MULTI3", "MULTI4", "MULTI5", "TXT_FRAGLIMIT",
+};
+
+EXTERN_CVAR (String, language)
+
+static FMessageTemplate KillMessages[NUM_KILLMESSAGES];
+static bool KillMessagesCompiled;
+static FString KillMessagesLanguage;
+
+void P_CompileMessageTemplates ()
+{
+    for (int i = 0; i < NUM_KILLMESSAGES; ++i)
+    {
+        KillMessages[i].Compile (GStrings(KillMessageNames[i]));
+    }
+    KillMessagesCompiled = true;
+    KillMessagesLanguage = language;
+}
+
+static const FMessageTemplate &P_GetKillMessage (int message)
+{
+    if (!KillMessagesCompiled || KillMessagesLanguage.Compare (language) != 0)
+    {
+        P_CompileMessageTemplates ();
+    }
+    return KillMessages[message];
+}
+
+//==========================================================================
+//
+// Presentation events
+//
+// Kill messages, feedback sounds and the like don't affect the
+// simulation, so AActor::Die and P_DamageMobj only queue a small record
+// for them. The presentation layer calls P_DrainPresentationEvents once
+// per frame; it merges events that would overwrite each other and handles
+// at most cl_maxpresentationevents of them, leaving the rest for the next
+// frame. Only the HUD text of kill messages is merged: every one still
+// makes its announcer call, for the actor it was queued for. The queue is
+// a fixed ring that drops its oldest entries when full.
+//
+// Until the first P_DrainPresentationEvents call, which is made from the
+// frame loop, events are run as soon as they are queued, so nothing is
+// lost where nothing drains the queue.
+//
+// Obituaries and leaving the automap stay in AActor::Die: the obituary
+// looks at the killer's weapon and the automap has to be gone before the
+// death view, and both can change by the time the queue is drained.
+//
+//==========================================================================
+
+CVAR (Int, cl_maxpresentationevents, 32, CVAR_ARCHIVE)
+
+enum EPresentationEvent
+{
+    PEV_KillMessage,
+    PEV_Sound,
+    PEV_Tactile,
+};
+
+enum EPresentationAnnounce
+{
+    PANN_None,
+    PANN_Spree,
+    PANN_SpreeLoss,
+    PANN_Multikill,
+};
+
+struct FPresentationEvent
+{
+    BYTE Type;
+    BYTE Announce;          // PEV_KillMessage: EPresentationAnnounce
+    int Tic;                // level.time when it was queued
+    SBYTE Victim, Killer;   // PEV_KillMessage: player numbers
+    int Param[3];           // PEV_KillMessage: color, ID, EKillMessage; PEV_Sound: channel, sound; PEV_Tactile: on, off, total
+    float FParam[2];        // PEV_KillMessage: y position; PEV_Sound: volume, attenuation
+    TObjPtr<AActor> Origin; // PEV_KillMessage: who the announcer speaks for; PEV_Sound: where it plays
+};
+
+enum { PEV_MAXQUEUED = 256 };
+
+static FPresentationEvent PresentationEvents[PEV_MAXQUEUED];
+static unsigned PresentationHead;           // oldest event
+static unsigned NumPresentationEvents;
+static bool PresentationDrained;            // the frame loop drains the queue
+
+// Returns the index'th oldest queued event.
+static inline FPresentationEvent &P_PresentationEvent (unsigned index)
+{
+    return PresentationEvents[(PresentationHead + index) % PEV_MAXQUEUED];
+}
+
+static FPresentationEvent &P_QueuePresentationEvent (int type)
+{
+    // Predicted hits and deaths are neither seen nor heard; their events
+    // go to a scratch record that is never run.
+    if (P_PredictingCombat ())
+    {
+        static FPresentationEvent scratch;
+        return scratch;
+    }
+    if (NumPresentationEvents >= PEV_MAXQUEUED)
+    {
+        PresentationHead = (PresentationHead + 1) % PEV_MAXQUEUED;
+        NumPresentationEvents--;
+    }
+    FPresentationEvent &ev = P_PresentationEvent (NumPresentationEvents++);
+    memset (&ev, 0, sizeof(ev));
+    ev.Type = (BYTE)type;
+    ev.Tic = level.time;
+    return ev;
+}
+
+static void P_RunPresentationEvents (int budget);
+
+// Called once a queued event has been filled in.
+static inline void P_PresentationEventQueued ()
+{
+    if (!PresentationDrained)
+    {
+        P_RunPresentationEvents (PEV_MAXQUEUED);
+    }
+}
+
+static void P_QueueKillMessage (int announce, AActor *announcer, int message, player_t *victim, player_t *killer,
+    int color, float y, DWORD id)
+{
+    FPresentationEvent &ev = P_QueuePresentationEvent (PEV_KillMessage);
+    ev.Announce = (BYTE)announce;
+    ev.Origin = announcer;
+    ev.Param[2] = message;
+    ev.Victim = SBYTE(victim - players);
+    ev.Killer = SBYTE(killer - players);
+    ev.Param[0] = color;
+    ev.Param[1] = id;
+    ev.FParam[0] = y;
+    P_PresentationEventQueued ();
+}
+
+// The same sound from the same origin on the same channel more than once
+// in a tic is played once, as loud as the loudest of them. The sounds
+// started this tic are remembered here, whether or not the queue is
+// drained, and a repeat only gets through if it is louder; when the queue
+// is drained, the earlier one is then superseded by it. The origins are
+// only compared, never followed.
+struct FTicSound
+{
+    AActor *Origin;
+    int Channel;
+    int Sound;
+    float Volume;
+};
+
+enum { TICSOUND_MAX = 32 };
+
+static FTicSound TicSounds[TICSOUND_MAX];
+static int NumTicSounds;
+static int TicSoundsTime = -1;
+
+static void P_QueueSound (AActor *origin, int channel, FSoundID sound, float volume, float attenuation)
+{
+    if (P_PredictingCombat ())
+    {
+        return;
+    }
+    if (TicSoundsTime != level.time)
+    {
+        TicSoundsTime = level.time;
+        NumTicSounds = 0;
+    }
+
+    int i;
+    for (i = 0; i < NumTicSounds; ++i)
+    {
+        FTicSound &played = TicSounds[i];
+        if (played.Origin == origin && played.Channel == channel && played.Sound == int(sound))
+        {
+            if (volume <= played.Volume)
+            {
+                return;
+            }
+            played.Volume = volume;
+            break;
+        }
+    }
+    if (i == NumTicSounds && NumTicSounds < TICSOUND_MAX)
+    {
+        FTicSound &played = TicSounds[NumTicSounds++];
+        played.Origin = origin;
+        played.Channel = channel;
+        played.Sound = sound;
+        played.Volume = volume;
+    }
+
+    FPresentationEvent &ev = P_QueuePresentationEvent (PEV_Sound);
+    ev.Origin = origin;
+    ev.Param[0] = channel;
+    ev.Param[1] = sound;
+    ev.FParam[0] = volume;
+    ev.FParam[1] = attenuation;
+    P_PresentationEventQueued ();
+}
+
+static void P_QueueTactile (int on, int off, int total)
+{
+    FPresentationEvent &ev = P_QueuePresentationEvent (PEV_Tactile);
+    ev.Param[0] = on;
+    ev.Param[1] = off;
+    ev.Param[2] = total;
+    P_PresentationEventQueued ();
+}
+
+// Returns true if a later event makes this one pointless.
+static bool P_IsSupersededEvent (unsigned index)
+{
+    FPresentationEvent &ev = P_PresentationEvent (index);
+
+    for (unsigned i = index + 1; i < NumPresentationEvents; ++i)
+    {
+        FPresentationEvent &later = P_PresentationEvent (i);
+        if (later.Type != ev.Type)
+        {
+            continue;
+        }
+        switch (ev.Type)
+        {
+        case PEV_KillMessage:   // AttachMessage replaces messages with the same ID
+            if (later.Param[1] == ev.Param[1]) return true;
+            break;
+
+        case PEV_Sound:
+            if (later.Origin == ev.Origin && later.Param[0] == ev.Param[0] && later.Param[1] == ev.Param[1])
+                return true;
+            break;
+
+        case PEV_Tactile:       // keep the strongest one
+            if (later.Param[2] >= ev.Param[2]) return true;
+            break;
+        }
+    }
+    return false;
+}
+
+//==========================================================================
+//
+// DAnnouncerMessage
+//
+// The spree and multikill messages are shown and replaced constantly in
+// busy deathmatch games. Instead of allocating a new HUD message each
+// time, every message ID gets one of these, which stays attached to the
+// status bar. When it runs out it goes dormant instead of being removed,
+// and the next announcement with that ID rewrites it in place.
+//
+//==========================================================================
+
+class DAnnouncerMessage : public DHUDMessageFadeOut
+{
+    DECLARE_CLASS (DAnnouncerMessage, DHUDMessageFadeOut)
+public:
+    enum { MAX_TEXT = 256 };
+
+    DAnnouncerMessage (const char *text, float y, EColorRange color);
+
+    void Serialize (FArchive &arc);
+    void Destroy ();
+    bool Tick ();
+    void Draw (int bottom, int visibility);
+    void Restart (float y, EColorRange color);
+
+    char Text[MAX_TEXT];
+    bool Dormant;
+
+private:
+    DAnnouncerMessage () {}
+};
+
+IMPLEMENT_CLASS (DAnnouncerMessage)
+
+// The status bar owns the messages; a slot only points at its message
+// until the message is destroyed, which clears it.
+static struct FAnnouncerSlot
+{
+    DWORD ID;
+    DAnnouncerMessage *Message;
+} AnnouncerSlots[4];
+
+DAnnouncerMessage::DAnnouncerMessage (const char *text, float y, EColorRange color)
+: DHUDMessageFadeOut (SmallFont, text, 1.5f, y, 0, 0, color, 3.f, 0.5f)
+{
+    strncpy (Text, text, MAX_TEXT - 1);
+    Text[MAX_TEXT - 1] = 0;
+    Dormant = false;
+}
+
+void DAnnouncerMessage::Serialize (FArchive &arc)
+{
+    Super::Serialize (arc);
+    arc << Dormant;
+}
+
+void DAnnouncerMessage::Destroy ()
+{
+    for (size_t i = 0; i < countof(AnnouncerSlots); ++i)
+    {
+        if (AnnouncerSlots[i].Message == this)
+        {
+            AnnouncerSlots[i].Message = NULL;
+        }
+    }
+    Super::Destroy ();
+}
+
+bool DAnnouncerMessage::Tick ()
+{
+    if (!Dormant && Super::Tick ())
+    {
+        Dormant = true;
+    }
+    return false;
+}
+
+void DAnnouncerMessage::Draw (int bottom, int visibility)
+{
+    if (!Dormant)
+    {
+        Super::Draw (bottom, visibility);
+    }
+}
+
+// Text has already been written into the message's own buffer.
+void DAnnouncerMessage::Restart (float y, EColorRange color)
+{
+    Top = y;
+    TextColor = color;
+    ResetText (Text);
+    Tics = 0;
+    State = 0;
+    Dormant = false;
+}
+
+// Returns the buffer the caller should format the message into, and the
+// slot to pass to P_ShowAnnouncerMessage afterwards.
+static char *P_GetAnnouncerBuffer (DWORD id, FAnnouncerSlot *&slot)
+{
+    static char scratch[DAnnouncerMessage::MAX_TEXT];
+    FAnnouncerSlot *freeslot = NULL;
+
+    for (size_t i = 0; i < countof(AnnouncerSlots); ++i)
+    {
+        if (AnnouncerSlots[i].Message == NULL)
+        {
+            if (freeslot == NULL) freeslot = &AnnouncerSlots[i];
+        }
+        else if (AnnouncerSlots[i].ID == id)
+        {
+            slot = &AnnouncerSlots[i];
+            return slot->Message->Text;
+        }
+    }
+    slot = freeslot;
+    if (slot != NULL)
+    {
+        slot->ID = id;
+    }
+    return scratch;
+}
+
+static void P_ShowAnnouncerMessage (FAnnouncerSlot *slot, char *text, float y, EColorRange color, DWORD id)
+{
+    if (slot != NULL && slot->Message != NULL)
+    {
+        slot->Message->Restart (y, color);
+        return;
+    }
+
+    DAnnouncerMessage *msg = new DAnnouncerMessage (text, y, color);
+    StatusBar->AttachMessage (msg, id);
+    if (slot != NULL)
+    {
+        slot->Message = msg;
+    }
+}
+
+// Player sounds like *drainhealth name a different sound for every player
+// class, skin and gender. Each player remembers what the last few it made
+// resolved to, so S_Sound gets the real sound and doesn't look it up again.
+struct FPlayerSoundSlot
+{
+    int Generic;
+    int Resolved;
+    const PClass *Class;
+    int Skin;
+    int Gender;
+};
+
+enum { PLAYERSOUND_SLOTS = 4 };
+
+static FPlayerSoundSlot PlayerSoundSlots[MAXPLAYERS][PLAYERSOUND_SLOTS];
+static int PlayerSoundNext[MAXPLAYERS];
+
+static FSoundID P_ResolvePlayerSound (AActor *actor, FSoundID sound)
+{
+    if (actor->player == NULL || actor->player->mo != actor)
+    {
+        return sound;
+    }
+
+    int pnum = int(actor->player - players);
+    const PClass *cls = actor->GetClass();
+    int skin = actor->player->userinfo.GetSkin();
+    int gender = actor->player->userinfo.GetGender();
+    FPlayerSoundSlot *slot = NULL;
+
+    for (int i = 0; i < PLAYERSOUND_SLOTS; ++i)
+    {
+        if (PlayerSoundSlots[pnum][i].Generic == int(sound))
+        {
+            slot = &PlayerSoundSlots[pnum][i];
+            if (slot->Class == cls && slot->Skin == skin && slot->Gender == gender)
+            {
+                return FSoundID(slot->Resolved);
+            }
+            break;
+        }
+    }
+    if (slot == NULL)
+    {
+        slot = &PlayerSoundSlots[pnum][PlayerSoundNext[pnum]];
+        PlayerSoundNext[pnum] = (PlayerSoundNext[pnum] + 1) % PLAYERSOUND_SLOTS;
+    }
+    slot->Generic = sound;
+    slot->Resolved = S_FindSkinnedSound (actor, sound);
+    slot->Class = cls;
+    slot->Skin = skin;
+    slot->Gender = gender;
+    return FSoundID(slot->Resolved);
+}
+
+// A superseded kill message still makes its announcer call, which plays
+// a sound of its own; only its HUD text is left to the later message.
+static void P_RunPresentationEvent (FPresentationEvent &ev, bool superseded)
+{
+    if (superseded && ev.Type != PEV_KillMessage)
+    {
+        return;
+    }
+    switch (ev.Type)
+    {
+    case PEV_KillMessage:
+    {
+        bool announced = false;
+
+        if (ev.Origin != NULL)
+        {
+            switch (ev.Announce)
+            {
+            case PANN_Spree:        announced = AnnounceSpree (ev.Origin);      break;
+            case PANN_SpreeLoss:    announced = AnnounceSpreeLoss (ev.Origin);  break;
+            case PANN_Multikill:    announced = AnnounceMultikill (ev.Origin);  break;
+            }
+        }
+        if (superseded || !playeringame[ev.Victim] || !playeringame[ev.Killer])
+        {
+            break;
+        }
+        player_t *victim = &players[ev.Victim];
+        player_t *killer = &players[ev.Killer];
+        if (!announced)
+        {
+            FAnnouncerSlot *slot;
+            char *buff = P_GetAnnouncerBuffer (ev.Param[1], slot);
+
+            P_GetKillMessage (ev.Param[2]).Format (buff, DAnnouncerMessage::MAX_TEXT, victim->userinfo.GetGender(),
+                victim->userinfo.GetName(), killer->userinfo.GetName());
+            P_ShowAnnouncerMessage (slot, buff, ev.FParam[0], EColorRange(ev.Param[0]), ev.Param[1]);
+        }
+        break;
+    }
+
+    case PEV_Sound:
+        if (ev.Origin != NULL)
+        {
+            S_Sound (ev.Origin, ev.Param[0], P_ResolvePlayerSound (ev.Origin, FSoundID(ev.Param[1])),
+                ev.FParam[0], ev.FParam[1]);
+        }
+        break;
+
+    case PEV_Tactile:
+        I_Tactile (ev.Param[0], ev.Param[1], ev.Param[2]);
+        break;
+    }
+}
+
+static void P_RunPresentationEvents (int budget)
+{
+    while (NumPresentationEvents > 0 && budget > 0)
+    {
+        bool superseded = P_IsSupersededEvent (0);
+        P_RunPresentationEvent (P_PresentationEvent (0), superseded);
+        if (!superseded)
+        {
+            budget--;
+        }
+        P_PresentationEvent (0).Origin = NULL;
+        PresentationHead = (PresentationHead + 1) % PEV_MAXQUEUED;
+        NumPresentationEvents--;
+    }
+}
+
+void P_DrainPresentationEvents ()
+{
+    PresentationDrained = true;
+    P_RunPresentationEvents (MAX<int> (cl_maxpresentationevents, 1));
+}
+
+void P_ClearPresentationEvents ()
+{
+    for (unsigned i = 0; i < NumPresentationEvents; ++i)
+    {
+        P_PresentationEvent (i).Origin = NULL;
+    }
+    PresentationHead = 0;
+    NumPresentationEvents = 0;
+}
+
+void P_MarkPresentationEvents ()
+{
+    for (unsigned i = 0; i < NumPresentationEvents; ++i)
+    {
+        GC::Mark (P_PresentationEvent (i).Origin);
+    }
+}
+
 void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
 {
+    bool predicting = P_PredictingCombat ();
+    P_CaptureCombatActor (this);
+    P_CaptureCombatActor (source);
+    if (!predicting)
+    {
+        MatchTelemetry.Update ();
+    }
+
     // Handle possible unmorph on death
     bool wasgibbed = (health < GibHealth());
 
     AActor *realthis = NULL;
     int realstyle = 0;
     int realhealth = 0;
-    if (P_MorphedDeath(this, &realthis, &realstyle, &realhealth))
+    if (!predicting && P_MorphedDeath(this, &realthis, &realstyle, &realhealth))
     {
         if (!(realstyle & MORPH_UNDOBYDEATHSAVES))
         {
@@ -20,6 +2193,7 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
             }
             realthis->Die(source, inflictor, dmgflags);
         }
+        P_TraceDeath (this, source, inflictor, DTX_DeathMorphed);
         return;
     }
 
@@ -27,26 +2201,25 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
     effects &= ~FX_RESPAWNINVUL;
     //flags &= ~MF_INVINCIBLE;
 
-    if (debugfile && this->player)
-    {
-        static int dieticks[MAXPLAYERS]; // [ZzZombo] not used? Except if for peeking in debugger...
-        int pnum = int(this->player-players);
-        dieticks[pnum] = gametic;
-        fprintf (debugfile, "died (%d) on tic %d (%s)\n", pnum, gametic,
-        this->player->cheats&CF_PREDICTING?"predicting":"real");
-    }
-
     // [RH] Notify this actor's items.
-    for (AInventory *item = Inventory; item != NULL; )
+    // Only actors that carry something that reacts to this walk the chain.
+    if (!predicting && Inventory != NULL && GetInventoryIndex().DeathSubscribers.Size() > 0)
     {
-        AInventory *next = item->Inventory;
-        item->OwnerDied();
-        item = next;
+        for (AInventory *item = Inventory; item != NULL; )
+        {
+            AInventory *next = item->Inventory;
+            item->OwnerDied();
+            item = next;
+        }
     }
 
     if (flags & MF_MISSILE)
     { // [RH] When missiles die, they just explode
-        P_ExplodeMissile (this, NULL, NULL);
+        P_TraceDeath (this, source, inflictor, DTX_DeathMissile);
+        if (!predicting)
+        {
+            P_ExplodeMissile (this, NULL, NULL);
+        }
         return;
     }
     // [RH] Set the target to the thing that killed it. Strife apparently does this.
@@ -55,10 +2228,12 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
         target = source;
     }
 
+    const FActorCombatInfo &combat = P_GetCombatInfo (GetClass());
+
     flags &= ~(MF_SHOOTABLE|MF_FLOAT|MF_SKULLFLY);
     if (!(flags4 & MF4_DONTFALL)) flags&=~MF_NOGRAVITY;
     flags |= MF_DROPOFF;
-    if ((flags3 & MF3_ISMONSTER) || FindState(NAME_Raise) != NULL || IsKindOf(RUNTIME_CLASS(APlayerPawn)))
+    if ((flags3 & MF3_ISMONSTER) || combat.CorpseEligible)
     {   // [RH] Only monsters get to be corpses.
         // Objects with a raise state should get the flag as well so they can
         // be revived by an Arch-Vile. Batman Doom needs this.
@@ -71,11 +2246,11 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
     fixed_t metaheight = 0;
     if (DamageType == NAME_Fire)
     {
-        metaheight = GetClass()->Meta.GetMetaFixed (AMETA_BurnHeight);
+        metaheight = combat.BurnHeight;
     }
     if (metaheight == 0)
     {
-        metaheight = GetClass()->Meta.GetMetaFixed (AMETA_DeathHeight);
+        metaheight = combat.DeathHeight;
     }
     if (metaheight != 0)
     {
@@ -93,7 +2268,7 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
     //      so now a level flag selects who the activator gets to be.
     // Everything is now moved to P_ActivateThingSpecial().
     if (special && (!(flags & MF_SPECIAL) || (flags3 & MF3_ISMONSTER))
-        && !(activationtype & THINGSPEC_NoDeathSpecial))
+        && !(activationtype & THINGSPEC_NoDeathSpecial) && !predicting)
     {
         P_ActivateThingSpecial(this, source, true); 
     }
@@ -116,16 +2291,11 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
             source->player->frags[player - players]++;
             if (player == source->player)   // [RH] Cumulative frag count
             {
-                char buff[256];
-
                 player->fragcount--;
                 if (deathmatch && player->spreecount >= 5 && cl_showsprees)
                 {
-                    SexMessage (GStrings("SPREEKILLSELF"), buff,
-                        player->userinfo.GetGender(), player->userinfo.GetName(),
-                        player->userinfo.GetName());
-                    StatusBar->AttachMessage (new DHUDMessageFadeOut (SmallFont, buff,
-                            1.5f, 0.2f, 0, 0, CR_WHITE, 3.f, 0.5f), MAKE_ID('K','S','P','R'));
+                    P_QueueKillMessage (PANN_None, NULL, KMSG_SpreeKillSelf, player, player,
+                        CR_WHITE, 0.2f, MAKE_ID('K','S','P','R'));
                 }
             }
             else
@@ -143,57 +2313,46 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
                     ++source->player->spreecount;
                 }
 
-                if (source->player->morphTics)
+                if (source->player->morphTics && !predicting)
                 { // Make a super chicken
                     source->GiveInventoryType (RUNTIME_CLASS(APowerWeaponLevel2));
                 }
 
                 if (deathmatch && cl_showsprees)
                 {
-                    const char *spreemsg;
-                    char buff[256];
+                    int spreemsg;
 
                     switch (source->player->spreecount)
                     {
                     case 5:
-                        spreemsg = GStrings("SPREE5");
+                        spreemsg = KMSG_Spree5;
                         break;
                     case 10:
-                        spreemsg = GStrings("SPREE10");
+                        spreemsg = KMSG_Spree10;
                         break;
                     case 15:
-                        spreemsg = GStrings("SPREE15");
+                        spreemsg = KMSG_Spree15;
                         break;
                     case 20:
-                        spreemsg = GStrings("SPREE20");
+                        spreemsg = KMSG_Spree20;
                         break;
                     case 25:
-                        spreemsg = GStrings("SPREE25");
+                        spreemsg = KMSG_Spree25;
                         break;
                     default:
-                        spreemsg = NULL;
+                        spreemsg = KMSG_None;
                         break;
                     }
 
-                    if (spreemsg == NULL && player->spreecount >= 5)
+                    if (spreemsg == KMSG_None && player->spreecount >= 5)
                     {
-                        if (!AnnounceSpreeLoss (this))
-                        {
-                            SexMessage (GStrings("SPREEOVER"), buff, player->userinfo.GetGender(),
-                                player->userinfo.GetName(), source->player->userinfo.GetName());
-                            StatusBar->AttachMessage (new DHUDMessageFadeOut (SmallFont, buff,
-                                1.5f, 0.2f, 0, 0, CR_WHITE, 3.f, 0.5f), MAKE_ID('K','S','P','R'));
-                        }
+                        P_QueueKillMessage (PANN_SpreeLoss, this, KMSG_SpreeOver, player, source->player,
+                            CR_WHITE, 0.2f, MAKE_ID('K','S','P','R'));
                     }
-                    else if (spreemsg != NULL)
+                    else if (spreemsg != KMSG_None)
                     {
-                        if (!AnnounceSpree (source))
-                        {
-                            SexMessage (spreemsg, buff, player->userinfo.GetGender(),
-                                player->userinfo.GetName(), source->player->userinfo.GetName());
-                            StatusBar->AttachMessage (new DHUDMessageFadeOut (SmallFont, buff,
-                                1.5f, 0.2f, 0, 0, CR_WHITE, 3.f, 0.5f), MAKE_ID('K','S','P','R'));
-                        }
+                        P_QueueKillMessage (PANN_Spree, source, spreemsg, player, source->player,
+                            CR_WHITE, 0.2f, MAKE_ID('K','S','P','R'));
                     }
                 }
             }
@@ -213,37 +2372,30 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
                         source->CheckLocalView (consoleplayer) &&
                         cl_showmultikills)
                     {
-                        const char *multimsg;
+                        int multimsg;
 
                         switch (source->player->multicount)
                         {
                         case 1:
-                            multimsg = NULL;
+                            multimsg = KMSG_None;
                             break;
                         case 2:
-                            multimsg = GStrings("MULTI2");
+                            multimsg = KMSG_Multi2;
                             break;
                         case 3:
-                            multimsg = GStrings("MULTI3");
+                            multimsg = KMSG_Multi3;
                             break;
                         case 4:
-                            multimsg = GStrings("MULTI4");
+                            multimsg = KMSG_Multi4;
                             break;
                         default:
-                            multimsg = GStrings("MULTI5");
+                            multimsg = KMSG_Multi5;
                             break;
                         }
-                        if (multimsg != NULL)
+                        if (multimsg != KMSG_None)
                         {
-                            char buff[256];
-
-                            if (!AnnounceMultikill (source))
-                            {
-                                SexMessage (multimsg, buff, player->userinfo.GetGender(),
-                                    player->userinfo.GetName(), source->player->userinfo.GetName());
-                                StatusBar->AttachMessage (new DHUDMessageFadeOut (SmallFont, buff,
-                                    1.5f, 0.8f, 0, 0, CR_RED, 3.f, 0.5f), MAKE_ID('M','K','I','L'));
-                            }
+                            P_QueueKillMessage (PANN_Multikill, source, multimsg, player, source->player,
+                                CR_RED, 0.8f, MAKE_ID('M','K','I','L'));
                         }
                     }
                 }
@@ -251,10 +2403,10 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
             }
 
             // [RH] Implement fraglimit
-            if (deathmatch && fraglimit &&
+            if (deathmatch && fraglimit && !predicting &&
                 fraglimit <= D_GetFragCount (source->player))
             {
-                Printf ("%s\n", GStrings("TXT_FRAGLIMIT"));
+                Printf ("%s\n", P_GetKillMessage (KMSG_FragLimit).Source.GetChars());
                 G_ExitLevel (0, false);
             }
         }
@@ -269,16 +2421,22 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
     if (player)
     {
         // [RH] Death messages
-        ClientObituary (this, inflictor, source, dmgflags);
+        if (!predicting)
+        {
+            ClientObituary (this, inflictor, source, dmgflags);
+        }
 
         // Death script execution, care of Skull Tag
-        FBehavior::StaticStartTypedScripts (SCRIPT_Death, this, true);
+        if (!predicting)
+        {
+            FBehavior::StaticStartTypedScripts (SCRIPT_Death, this, true);
+        }
 
         // [RH] Force a delay between death and respawn
         player->respawn_time = level.time + TICRATE;
 
         //Added by MC: Respawn bots
-        if (bglobal.botnum && !demoplayback)
+        if (bglobal.botnum && !demoplayback && !predicting)
         {
             if (player->Bot != NULL)
                 player->Bot->t_respawn = (pr_botrespawn()%15)+((bglobal.botnum-1)*2)+TICRATE+1;
@@ -307,11 +2465,17 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
                         
         flags &= ~MF_SOLID;
         player->playerstate = PST_DEAD;
-        P_DropWeapon (player);
+        if (!predicting)
+        {
+            P_DropWeapon (player);
+        }
         if (this == players[consoleplayer].camera && automapactive)
         {
             // don't die in auto map, switch view prior to dying
-            AM_Stop ();
+            if (!predicting)
+            {
+                AM_Stop ();
+            }
         }
 
         // [GRB] Clear extralight. When you killed yourself with weapon that
@@ -324,7 +2488,11 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
     // the level.
     if (flags & MF_UNMORPHED)
     {
-        Destroy ();
+        P_TraceDeath (this, source, inflictor, DTX_DeathUnmorphed);
+        if (!predicting)
+        {
+            Destroy ();
+        }
         return;
     }
 
@@ -350,18 +2518,16 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
     // 4. If no state has been found and death is extreme, try the extreme death state
     // 5. If no such state is found or death is not extreme try the regular death state.
     // 6. If still no state has been found, destroy the actor immediately.
+    //
+    // Steps 1+2 and 4+5 were resolved for this class by BuildCombatInfo.
 
     if (DamageType != NAME_None)
     {
-        if (extremelydead)
-        {
-            FName labels[] = { NAME_Death, NAME_Extreme, DamageType };
-            diestate = FindState(3, labels, true);
-        }
-        if (diestate == NULL)
+        const FDeathResolution &res = combat.GetTypeInfo (DamageType).Death.Resolved[extremelydead];
+        if (res.State != NULL)
         {
-            diestate = FindState (NAME_Death, DamageType, true);
-            if (diestate != NULL) extremelydead = false;
+            diestate = res.State;
+            extremelydead = res.Extreme;
         }
         if (diestate == NULL)
         {
@@ -370,7 +2536,7 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
 
                 if (!deh.NoAutofreeze && !(flags4 & MF4_NOICEDEATH) && (player || (flags3 & MF3_ISMONSTER)))
                 {
-                    diestate = FindState(NAME_GenericFreezeDeath);
+                    diestate = combat.GenericFreezeDeath;
                     extremelydead = false;
                 }
             }
@@ -387,15 +2553,9 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
             DamageType = NAME_None; 
         }
 
-        if (extremelydead)
-        { // Extreme death
-            diestate = FindState (NAME_Death, NAME_Extreme, true);
-        }
-        if (diestate == NULL)
-        { // Normal death
-            extremelydead = false;
-            diestate = FindState (NAME_Death);
-        }
+        const FDeathResolution &res = combat.UntypedDeath.Resolved[extremelydead];
+        diestate = res.State;
+        extremelydead = res.Extreme;
     }
 
     if (extremelydead)
@@ -414,32 +2574,134 @@ void AActor::Die (AActor *source, AActor *inflictor, int dmgflags)
         }
     }
 
-    if (diestate != NULL)
+    P_TraceDeath (this, source, inflictor, diestate != NULL ? DTX_DeathState : DTX_DeathDestroyed);
+
+    if (diestate != NULL)
+    {
+        SetState (diestate, predicting);
+
+        if (tics > 1)
+        {
+            tics -= pr_killmobj() & 3;
+            if (tics < 1)
+                tics = 1;
+        }
+    }
+    else if (!predicting)
+    {
+        Destroy();
+    }
+}
+
+//==========================================================================
+//
+// P_KickbackThrust
+//
+// The thrust damage kickback gives a target: damage * kickback / 8 / mass
+// in fixed point, clamped to [0, limit], rounded to nearest (ties to even,
+// as FLOAT2FIXED does). It is done entirely in integers, so it does not
+// depend on how a compiler or FPU evaluates doubles. For any mass below
+// 2^28 the result is the same as the old double calculation, since the
+// exact quotient is then never close enough to a rounding boundary for
+// the double's error to matter.
+//
+//==========================================================================
+
+static fixed_t P_KickbackThrust (int damage, int kickback, int mass, fixed_t limit)
+{
+    if (mass <= 0)
+    {
+        return limit;
+    }
+
+    SQWORD num = (SQWORD)damage * kickback * FRACUNIT;
+    SQWORD den = (SQWORD)mass * 8;
+    if (num <= 0)
     {
-        SetState (diestate);
+        return 0;
+    }
 
-        if (tics > 1)
-        {
-            tics -= pr_killmobj() & 3;
-            if (tics < 1)
-                tics = 1;
-        }
+    SQWORD quot = num / den;
+    SQWORD rem = num % den;
+    if (rem * 2 > den || (rem * 2 == den && (quot & 1)))
+    {
+        quot++;
     }
-    else
+    return quot > limit ? limit : fixed_t(quot);
+}
+
+//==========================================================================
+//
+// FDamageContext
+//
+// Everything about a damage event that depends only on the inflictor,
+// the source, the damage type and the flags. A single P_DamageMobj call
+// builds one of these for itself; P_DamageMobjBatch builds one for the
+// whole batch and reuses it for every target. Nothing here may depend on
+// the source's ready weapon: a hit earlier in a batch can kill the source
+// or make it switch weapons, so the kickback is looked up for each target.
+//
+//==========================================================================
+
+struct FDamageContext
+{
+    AActor *Inflictor;
+    AActor *Source;
+    AActor *ThrustOrigin;   // where kickback pushes away from
+    FName Mod;
+    int Flags;              // DMG_NO_ARMOR already folded in for PIERCEARMOR inflictors
+    bool CanThrust;         // inflictor/source side of the kickback checks
+};
+
+static void P_InitDamageContext (FDamageContext &ctx, AActor *inflictor, AActor *source, FName mod, int flags)
+{
+    if (inflictor != NULL && (inflictor->flags5 & MF5_PIERCEARMOR))
     {
-        Destroy();
+        flags |= DMG_NO_ARMOR;
     }
+
+    ctx.Inflictor = inflictor;
+    ctx.Source = source;
+    ctx.Mod = mod;
+    ctx.Flags = flags;
+
+    // Push the target unless the source's weapon's kickback is 0.
+    // (i.e. Gauntlets/Chainsaw)
+    ctx.CanThrust = inflictor != NULL
+        && !(inflictor->flags2 & MF2_NODMGTHRUST)
+        && !(flags & DMG_THRUSTLESS)
+        && (source == NULL || source->player == NULL || !(source->flags2 & MF2_NODMGTHRUST));
+
+    ctx.ThrustOrigin = (source && (flags & DMG_INFLICTOR_IS_PUFF))? source : inflictor;
 }
 
-int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage, FName mod, int flags)
+//==========================================================================
+//
+// P_DamageMobjVariant
+//
+// The damage path, compiled once for each combination of the conditions
+// that decide most of its branches: whether the damage is DMG_FORCED,
+// whether the target is a player, and whether any class scales any known
+// damage type by a factor other than 1. P_DamageMobjContext picks the
+// variant, so a plain monster-on-monster hit runs without the forced and
+// player checks, and games without typed factors skip the factor lookup.
+//
+//==========================================================================
+
+template<bool Forced, bool PlayerTarget, bool TypedFactors>
+static int P_DamageMobjVariant (AActor *target, const FDamageContext &ctx, int damage)
 {
+    AActor *inflictor = ctx.Inflictor;
+    AActor *source = ctx.Source;
+    FName mod = ctx.Mod;
+    int flags = ctx.Flags;
     unsigned ang;
     player_t *player = NULL;
     fixed_t thrust;
     int temp;
     int painchance = 0;
     FState * woundstate = NULL;
-    PainChanceList * pc = NULL;
+    const FPainInfo * paininfo = NULL;
     bool justhit = false;
     bool plrDontThrust = false;
     bool invulpain = false;
@@ -448,11 +2710,13 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
     int fakeDamage = 0;
     int holdDamage = 0;
     int rawdamage = damage; 
+    bool predicting = P_PredictingCombat ();
     
     if (damage < 0) damage = 0;
 
     if (target == NULL || !((target->flags & MF_SHOOTABLE) || (target->flags6 & MF6_VULNERABLE)))
     { // Shouldn't happen
+        DMGTRACE_EXIT(DTX_Unshootable);
         return -1;
     }
 
@@ -465,11 +2729,13 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
     {
         if (inflictor == NULL || !(inflictor->flags4 & MF4_SPECTRAL))
         {
+            DMGTRACE_EXIT(DTX_Spectral);
             return -1;
         }
     }
     if (target->health <= 0)
     {
+        DMGTRACE_EXIT(DTX_AlreadyDead);
         if (inflictor && mod == NAME_Ice && !(inflictor->flags7 & MF7_ICESHATTER))
         {
             return -1;
@@ -486,7 +2752,7 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
     // different here. At any rate, invulnerable is being checked before type factoring, which is then being 
     // checked by player cheats/invul/buddha followed by monster buddha. This is inconsistent. Don't let the 
     // original telefrag damage CHECK (rawdamage) be influenced by outside factors when looking at cheats/invul.
-    if ((target->flags2 & MF2_INVULNERABLE) && (rawdamage < TELEFRAG_DAMAGE) && (!(flags & DMG_FORCED)))
+    if ((target->flags2 & MF2_INVULNERABLE) && (rawdamage < TELEFRAG_DAMAGE) && !Forced)
     { // actor is invulnerable
         if (target->player == NULL)
         {
@@ -498,10 +2764,11 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
                     // We cannot run the various damage filters below so for consistency it needs to be 0.
                     damage = 0;
                     invulpain = true;
+                    DMGTRACE_EXIT(DTX_FakePain);
                     goto fakepain;
                 }
-                else
-                    return -1;
+                DMGTRACE_EXIT(DTX_Invulnerable);
+                return -1;
             }
         }
         else
@@ -512,18 +2779,15 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
                 if (fakedPain)
                     plrDontThrust = 1;
                 else
+                {
+                    DMGTRACE_EXIT(DTX_Invulnerable);
                     return -1;
+                }
             }
         }
         
     }
 
-    if (inflictor != NULL)
-    {
-        if (inflictor->flags5 & MF5_PIERCEARMOR)
-            flags |= DMG_NO_ARMOR;
-    }
-    
     MeansOfDeath = mod;
     // [RH] Andy Baker's Stealth monsters
     if (target->flags & MF_STEALTH)
@@ -536,12 +2800,13 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
         target->velx = target->vely = target->velz = 0;
     }
 
-    player = target->player;
-    if (!(flags & DMG_FORCED))  // DMG_FORCED skips all special damage checks, TELEFRAG_DAMAGE may not be reduced at all
+    player = PlayerTarget ? target->player : NULL;
+    if (!Forced)  // DMG_FORCED skips all special damage checks, TELEFRAG_DAMAGE may not be reduced at all
     {
         if (target->flags2 & MF2_DORMANT)
         {
             // Invulnerable, and won't wake up
+            DMGTRACE_EXIT(DTX_Dormant);
             return -1;
         }
 
@@ -552,6 +2817,7 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
                 // Take half damage in trainer mode
                 damage = FixedMul(damage, G_SkillProperty(SKILLP_DamageFactor));
             }
+            DMGTRACE_STAGE(DTS_Skill, damage);
             // Special damage types
             if (inflictor)
             {
@@ -560,16 +2826,23 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
                     if (player != NULL)
                     {
                         if (!deathmatch && inflictor->FriendPlayer > 0)
+                        {
+                            DMGTRACE_EXIT(DTX_Spectral);
                             return -1;
+                        }
                     }
                     else if (target->flags4 & MF4_SPECTRAL)
                     {
                         if (inflictor->FriendPlayer == 0 && !target->IsHostile(inflictor))
+                        {
+                            DMGTRACE_EXIT(DTX_Spectral);
                             return -1;
+                        }
                     }
                 }
 
                 damage = inflictor->DoSpecialDamage(target, damage, mod);
+                DMGTRACE_STAGE(DTS_Special, damage);
                 if (damage < 0)
                 {
                     return -1;
@@ -585,21 +2858,27 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
                 // Handle active damage modifiers (e.g. PowerDamage)
                 if (damage > 0 && source->Inventory != NULL)
                 {
-                    source->Inventory->ModifyDamage(damage, mod, damage, false);
+                    P_ModifyDamage (source, damage, mod, false);
                 }
+                DMGTRACE_STAGE(DTS_Multiply, damage);
             }
             // Handle passive damage modifiers (e.g. PowerProtection), provided they are not afflicted with protection penetrating powers.
             if (damage > 0 && (target->Inventory != NULL) && !(flags & DMG_NO_PROTECT))
             {
-                target->Inventory->ModifyDamage(damage, mod, damage, true);
+                P_ModifyDamage (target, damage, mod, true);
+                DMGTRACE_STAGE(DTS_Protection, damage);
             }
             if (damage > 0 && !(flags & DMG_NO_FACTOR))
             {
                 damage = FixedMul(damage, target->DamageFactor);
-                if (damage > 0)
+                // Without typed factors every known type scales by exactly 1.
+                int dmgtype = P_GetDamageTypeID (mod);
+                if (damage > 0 && (TypedFactors || dmgtype == DMGTYPE_Unknown))
                 {
-                    damage = DamageTypeDefinition::ApplyMobjDamageFactor(damage, mod, target->GetClass()->ActorInfo->DamageFactors);
+                    damage = dmgtype != DMGTYPE_Unknown ? FixedMul(damage, P_GetDamageTypeInfo (target, mod).Factor) :
+                        DamageTypeDefinition::ApplyMobjDamageFactor(damage, mod, target->GetClass()->ActorInfo->DamageFactors);
                 }
+                DMGTRACE_STAGE(DTS_Factor, damage);
             }
 
             if (damage >= 0)
@@ -611,12 +2890,14 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
             if (damage == 0 && olddam > 0)
             {
                 { // Still allow FORCEPAIN
+                    DMGTRACE_EXIT(DTX_Nullified);
                     if (forcedPain)
                     {
                         goto dopain;
                     }
                     else if (fakedPain)
                     {
+                        DMGTRACE_EXIT(DTX_FakePain);
                         goto fakepain;
                     }
                     return -1;
@@ -635,12 +2916,9 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
     }
     // Push the target unless the source's weapon's kickback is 0.
     // (i.e. Gauntlets/Chainsaw)
-    if (!plrDontThrust && inflictor && inflictor != target  // [RH] Not if hurting own self
+    if (!plrDontThrust && ctx.CanThrust && inflictor != target  // [RH] Not if hurting own self
         && !(target->flags & MF_NOCLIP)
-        && !(inflictor->flags2 & MF2_NODMGTHRUST)
-        && !(flags & DMG_THRUSTLESS)
-        && !(target->flags7 & MF7_DONTTHRUST)
-        && (source == NULL || source->player == NULL || !(source->flags2 & MF2_NODMGTHRUST)))
+        && !(target->flags7 & MF7_DONTTHRUST))
     {
         int kickback;
 
@@ -653,7 +2931,7 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
 
         if (kickback)
         {
-            AActor *origin = (source && (flags & DMG_INFLICTOR_IS_PUFF))? source : inflictor;
+            AActor *origin = ctx.ThrustOrigin;
 
             // If the origin and target are in exactly the same spot, choose a random direction.
             // (Most likely cause is from telefragging somebody during spawning because they
@@ -667,17 +2945,9 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
                 ang = origin->AngleTo(target);
             }
 
-            // Calculate this as float to avoid overflows so that the
-            // clamping that had to be done here can be removed.
-            double fltthrust;
-
-            fltthrust = mod == NAME_MDK ? 10 : 32;
-            if (target->Mass > 0)
-            {
-                fltthrust = clamp((damage * 0.125 * kickback) / target->Mass, 0., fltthrust);
-            }
-
-            thrust = FLOAT2FIXED(fltthrust);
+            // Calculated in 64-bit integers to avoid overflows, and so that
+            // it comes out the same on every platform.
+            thrust = P_KickbackThrust (damage, kickback, target->Mass, (mod == NAME_MDK ? 10 : 32) * FRACUNIT);
 
             // Don't apply ultra-small damage thrust
             if (thrust < FRACUNIT/100) thrust = 0;
@@ -697,8 +2967,8 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
             }
             ang >>= ANGLETOFINESHIFT;
             if (source && source->player && (flags & DMG_INFLICTOR_IS_PUFF)
-                && source->player->ReadyWeapon != NULL &&
-                (source->player->ReadyWeapon->WeaponFlags & WIF_STAFF2_KICKBACK))
+                && source->player->ReadyWeapon != NULL
+                && (source->player->ReadyWeapon->WeaponFlags & WIF_STAFF2_KICKBACK))
             {
                 // Staff power level 2
                 target->velx += FixedMul (10*FRACUNIT, finecosine[ang]);
@@ -717,7 +2987,7 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
     }
 
     // [RH] Avoid friendly fire if enabled
-    if (!(flags & DMG_FORCED) && source != NULL &&
+    if (!Forced && source != NULL &&
         ((player && player != source->player) || (!player && target != source)) &&
         target->IsTeammate (source))
     {
@@ -725,18 +2995,22 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
         if (rawdamage < TELEFRAG_DAMAGE || (target->flags7 & MF7_LAXTELEFRAGDMG)) 
         { // Still allow telefragging :-(
             damage = (int)((float)damage * level.teamdamage);
+            DMGTRACE_STAGE(DTS_TeamDamage, damage);
             if (damage < 0)
             {
+                DMGTRACE_EXIT(DTX_Friendly);
                 return damage;
             }
             else if (damage == 0)
             {
+                DMGTRACE_EXIT(DTX_Friendly);
                 if (forcedPain)
                 {
                     goto dopain;
                 }
                 else if (fakedPain)
                 {
+                    DMGTRACE_EXIT(DTX_FakePain);
                     goto fakepain;
                 }
                 return -1;
@@ -761,7 +3035,7 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
             damage = target->health - 1;
         }
 
-        if (!(flags & DMG_FORCED))
+        if (!Forced)
         {
             // check the real player, not a voodoo doll here for invulnerability effects
             if ((rawdamage < TELEFRAG_DAMAGE && ((player->mo->flags2 & MF2_INVULNERABLE) ||
@@ -771,11 +3045,13 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
             { // player is invulnerable, so don't hurt him
                 //Make sure no godmodes and NOPAIN flags are found first.
                 //Then, check to see if the player has NODAMAGE or ALLOWPAIN, or inflictor has CAUSEPAIN.
+                DMGTRACE_EXIT(DTX_GodMode);
                 if ((player->cheats & CF_GODMODE) || (player->cheats & CF_GODMODE2) || (player->mo->flags5 & MF5_NOPAIN))
                     return -1;
                 else if ((((player->mo->flags7 & MF7_ALLOWPAIN) || (player->mo->flags5 & MF5_NODAMAGE)) || ((inflictor != NULL) && (inflictor->flags7 & MF7_CAUSEPAIN))))
                 {
                     invulpain = true;
+                    DMGTRACE_EXIT(DTX_FakePain);
                     goto fakepain;
                 }
                 else
@@ -787,16 +3063,18 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
                 int newdam = damage;
                 if (damage > 0)
                 {
-                    player->mo->Inventory->AbsorbDamage(damage, mod, newdam);
+                    P_AbsorbDamage (player->mo, damage, mod, newdam);
                 }
                 if ((rawdamage < TELEFRAG_DAMAGE) || (player->mo->flags7 & MF7_LAXTELEFRAGDMG)) //rawdamage is never modified.
                 {
                     // if we are telefragging don't let the damage value go below that magic value. Some further checks would fail otherwise.
                     damage = newdam;
                 }
+                DMGTRACE_STAGE(DTS_Armor, damage);
 
                 if (damage <= 0)
                 {
+                    DMGTRACE_EXIT(DTX_Nullified);
                     // If MF6_FORCEPAIN is set, make the player enter the pain state.
                     if (!(target->flags5 & MF5_NOPAIN) && inflictor != NULL &&
                         (inflictor->flags6 & MF6_FORCEPAIN) && !(inflictor->flags5 & MF5_PAINLESS) 
@@ -810,7 +3088,8 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
             
             if (damage >= player->health && rawdamage < TELEFRAG_DAMAGE
                 && (G_SkillProperty(SKILLP_AutoUseHealth) || deathmatch)
-                && !player->morphTics)
+                && !player->morphTics && !predicting
+                && player->mo->GetInventoryIndex().HealthItems.Size() > 0)
             { // Try to use some inventory health
                 P_AutoUseHealth (player, damage - player->health + 1);
             }
@@ -819,9 +3098,12 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
         player->health -= damage;       // mirror mobj health here for Dave
         // [RH] Make voodoo dolls and real players record the same health
         target->health = player->mo->health -= damage;
-        if (player->health < 50 && !deathmatch && !(flags & DMG_FORCED))
+        if (player->health < 50 && !deathmatch && !Forced)
         {
-            P_AutoUseStrifeHealth (player);
+            if (!predicting && player->mo->GetInventoryIndex().HealthItems.Size() > 0)
+            {
+                P_AutoUseStrifeHealth (player);
+            }
             player->mo->health = player->health;
         }
         if (player->health <= 0)
@@ -832,7 +3114,7 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
             // but telefragging should still do enough damage to kill the player)
             // Ignore players that are already dead.
             // [MC]Buddha2 absorbs telefrag damage, and anything else thrown their way.
-            if (!(flags & DMG_FORCED) && (((player->cheats & CF_BUDDHA2) || (((player->cheats & CF_BUDDHA) || (player->mo->flags7 & MF7_BUDDHA)) && (rawdamage < TELEFRAG_DAMAGE))) && (player->playerstate != PST_DEAD)))
+            if (!Forced && (((player->cheats & CF_BUDDHA2) || (((player->cheats & CF_BUDDHA) || (player->mo->flags7 & MF7_BUDDHA)) && (rawdamage < TELEFRAG_DAMAGE))) && (player->playerstate != PST_DEAD)))
             {
                 // If this is a voodoo doll we need to handle the real player as well.
                 player->mo->health = target->health = player->health = 1;
@@ -852,23 +3134,27 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
         temp = damage < 100 ? damage : 100;
         if (player == &players[consoleplayer])
         {
-            I_Tactile (40,10,40+temp*2);
+            P_QueueTactile (40,10,40+temp*2);
         }
     }
     else
     {
         // Armor for monsters.
-        if (!(flags & (DMG_NO_ARMOR|DMG_FORCED)) && target->Inventory != NULL && damage > 0)
+        if (!Forced && !(flags & DMG_NO_ARMOR) && target->Inventory != NULL && damage > 0)
         {
             int newdam = damage;
-            target->Inventory->AbsorbDamage (damage, mod, newdam);
+            P_AbsorbDamage (target, damage, mod, newdam);
             damage = newdam;
+            DMGTRACE_STAGE(DTS_Armor, damage);
             if (damage <= 0)
             {
                 if (fakedPain)
+                {
+                    DMGTRACE_EXIT(DTX_FakePain);
                     goto fakepain;
-                else
-                    return damage;
+                }
+                DMGTRACE_EXIT(DTX_Nullified);
+                return damage;
             }
         }
     
@@ -888,7 +3174,8 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
         {
             if ( P_GiveBody( source, damage / 2 ))
             {
-                S_Sound( source, CHAN_ITEM, "*drainhealth", 1, ATTN_NORM );
+                static FSoundID drainsound ("*drainhealth");
+                P_QueueSound (source, CHAN_ITEM, drainsound, 1, ATTN_NORM);
             }
         }
     }
@@ -897,9 +3184,10 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
     if (target->health <= 0)
     { 
         //[MC]Buddha flag for monsters.
-        if (!(flags & DMG_FORCED) && ((target->flags7 & MF7_BUDDHA) && (rawdamage < TELEFRAG_DAMAGE) && ((inflictor == NULL || !(inflictor->flags7 & MF7_FOILBUDDHA)) && !(flags & DMG_FOILBUDDHA))))
+        if (!Forced && ((target->flags7 & MF7_BUDDHA) && (rawdamage < TELEFRAG_DAMAGE) && ((inflictor == NULL || !(inflictor->flags7 & MF7_FOILBUDDHA)) && !(flags & DMG_FOILBUDDHA))))
         { //FOILBUDDHA or Telefrag damage must kill it.
             target->health = 1;
+            DMGTRACE_EXIT(DTX_Buddha);
         }
         else
         {
@@ -939,19 +3227,20 @@ int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage,
                     source = source->tracer;
                 }
             }
+            DMGTRACE_EXIT(DTX_Death);
             target->Die (source, inflictor, flags);
             return damage;
         }
     }
 
-    woundstate = target->FindState(NAME_Wound, mod);
+    paininfo = &P_GetPainInfo (target, mod);
+    woundstate = paininfo->WoundState;
     if (woundstate != NULL)
     {
-        int woundhealth = RUNTIME_TYPE(target)->Meta.GetMetaInt (AMETA_WoundHealth, 6);
-
-        if (target->health <= woundhealth)
+        if (target->health <= paininfo->WoundHealth)
         {
-            target->SetState (woundstate);
+            target->SetState (woundstate, predicting);
+            DMGTRACE_EXIT(DTX_Wound);
             return damage;
         }
     }
@@ -961,34 +3250,30 @@ fakepain: //Needed so we can skip the rest of the above, but still obey the orig
     if (!(target->flags5 & MF5_NOPAIN) && (inflictor == NULL || !(inflictor->flags5 & MF5_PAINLESS)) &&
         (target->player != NULL || !G_SkillProperty(SKILLP_NoPain)) && !(target->flags & MF_SKULLFLY))
     {
-        pc = target->GetClass()->ActorInfo->PainChances;
-        painchance = target->PainChance;
-        if (pc != NULL)
+        if (paininfo == NULL)
         {
-            int *ppc = pc->CheckKey(mod);
-            if (ppc != NULL)
-            {
-                painchance = *ppc;
-            }
+            paininfo = &P_GetPainInfo (target, mod);
         }
+        painchance = paininfo->HasPainChance ? paininfo->PainChance : target->PainChance;
 
         if (((damage >= target->PainThreshold) && (pr_damagemobj() < painchance)) 
             || (inflictor != NULL && (inflictor->flags6 & MF6_FORCEPAIN)))
         {
 dopain: 
+            DMGTRACE_EXIT(DTX_Pain);
             if (mod == NAME_Electric)
             {
                 if (pr_lightning() < 96)
                 {
                     justhit = true;
-                    FState *painstate = target->FindState(NAME_Pain, mod);
+                    FState *painstate = P_GetPainInfo (target, mod).PainState;
                     if (painstate != NULL)
-                        target->SetState(painstate);
+                        target->SetState(painstate, predicting);
                 }
                 else
                 { // "electrocute" the target
                     target->renderflags |= RF_FULLBRIGHT;
-                    if ((target->flags3 & MF3_ISMONSTER) && pr_lightning() < 128)
+                    if ((target->flags3 & MF3_ISMONSTER) && pr_lightning() < 128 && !predicting)
                     {
                         target->Howl ();
                     }
@@ -997,12 +3282,12 @@ dopain:
             else
             {
                 justhit = true;
-                FState *painstate = target->FindState(NAME_Pain, ((inflictor && inflictor->PainType != NAME_None) ? inflictor->PainType : mod));
+                FState *painstate = P_GetPainInfo (target, (inflictor && inflictor->PainType != NAME_None) ? inflictor->PainType : mod).PainState;
                 if (painstate != NULL)
-                    target->SetState(painstate);
+                    target->SetState(painstate, predicting);
                 if (mod == NAME_PoisonCloud)
                 {
-                    if ((target->flags3 & MF3_ISMONSTER) && pr_poison() < 128)
+                    if ((target->flags3 & MF3_ISMONSTER) && pr_poison() < 128 && !predicting)
                     {
                         target->Howl ();
                     }
@@ -1019,7 +3304,7 @@ dopain:
             target->threshold = BASETHRESHOLD;
             if (target->state == target->SpawnState && target->SeeState != NULL)
             {
-                target->SetState (target->SeeState);
+                target->SetState (target->SeeState, predicting);
             }
         }
         else if (source != target->target && target->OkayToSwitchTarget (source))
@@ -1040,7 +3325,7 @@ dopain:
             target->threshold = BASETHRESHOLD;
             if (target->state == target->SpawnState && target->SeeState != NULL)
             {
-                target->SetState (target->SeeState);
+                target->SetState (target->SeeState, predicting);
             }
         }
     }
@@ -1054,4 +3339,668 @@ dopain:
         return -1; //NOW we return -1!
     }
     return damage;
-}
\ No newline at end of file
+}
+
+typedef int (*DamageMobjFunc) (AActor *target, const FDamageContext &ctx, int damage);
+
+static const DamageMobjFunc DamageMobjVariants[8] =
+{
+    P_DamageMobjVariant<false, false, false>,
+    P_DamageMobjVariant<false, false, true>,
+    P_DamageMobjVariant<false, true, false>,
+    P_DamageMobjVariant<false, true, true>,
+    P_DamageMobjVariant<true, false, false>,
+    P_DamageMobjVariant<true, false, true>,
+    P_DamageMobjVariant<true, true, false>,
+    P_DamageMobjVariant<true, true, true>,
+};
+
+static inline int P_DamageMobjContext (AActor *target, const FDamageContext &ctx, int damage)
+{
+    P_CaptureCombatActor (target);
+    P_CaptureCombatActor (ctx.Source);
+
+    int variant = ((ctx.Flags & DMG_FORCED) ? 4 : 0)
+        | ((target != NULL && target->player != NULL) ? 2 : 0)
+        | (DamageFeatures.TypedFactors ? 1 : 0);
+    int result = DamageMobjVariants[variant] (target, ctx, damage);
+
+    if (result > 0 && MatchTelemetry.IsActive () && !P_PredictingCombat ())
+    {
+        MatchTelemetry.AddDamage (P_GetDamageTypeID (ctx.Mod), result);
+    }
+    return result;
+}
+
+static int P_DamageMobjTraced (AActor *target, const FDamageContext &ctx, int damage)
+{
+    if (!DamageTrace.IsActive () && DamageExitCounts == NULL)
+    {
+        return P_DamageMobjContext (target, ctx, damage);
+    }
+
+    // Damage can recurse (e.g. through Die or DoSpecialDamage), so each
+    // level gets its own record.
+    FDamageTraceRecord rec;
+    FDamageTraceRecord *outer = CurrentDamageTrace;
+
+    P_InitTraceRecord (rec, DTK_Damage, target, ctx.Inflictor, ctx.Source, ctx.Mod);
+    rec.RawDamage = damage;
+    CurrentDamageTrace = &rec;
+    rec.Result = P_DamageMobjContext (target, ctx, damage);
+    CurrentDamageTrace = outer;
+    if (rec.Exit == DTX_None)
+    {
+        rec.Exit = rec.Result < 0 ? DTX_Cancelled : DTX_Damaged;
+    }
+    if (DamageExitCounts != NULL)
+    {
+        DamageExitCounts[rec.Exit]++;
+    }
+    if (DamageTrace.IsActive ())
+    {
+        DamageTrace.Push (rec);
+    }
+    return rec.Result;
+}
+
+int P_DamageMobj (AActor *target, AActor *inflictor, AActor *source, int damage, FName mod, int flags)
+{
+    FDamageContext ctx;
+
+    P_InitDamageContext (ctx, inflictor, source, mod, flags);
+    return P_DamageMobjTraced (target, ctx, damage);
+}
+
+//==========================================================================
+//
+// Hot actor fields
+//
+// The AActor fields that P_DamageMobj and AActor::Die read on nearly
+// every hit. They are spread over much of the actor, so P_DamageMobjBatch
+// prefetches every cache line that holds one of them, not just the first
+// line of the actor; the fields are not regrouped within AActor itself. "benchdamage layout" reports how many lines that is.
+// Keep this in sync when the damage path starts reading another field.
+//
+//==========================================================================
+
+struct FActorHotField
+{
+    const char *Name;
+    size_t Offset;
+    size_t Size;
+};
+
+#define HOTFIELD(f)     { #f, myoffsetof(AActor, f), sizeof(((AActor *)0)->f) }
+
+static FActorHotField ActorHotFields[] =
+{
+    HOTFIELD(flags),
+    HOTFIELD(flags2),
+    HOTFIELD(flags3),
+    HOTFIELD(flags4),
+    HOTFIELD(flags5),
+    HOTFIELD(flags6),
+    HOTFIELD(flags7),
+    HOTFIELD(health),
+    HOTFIELD(Mass),
+    HOTFIELD(PainChance),
+    HOTFIELD(PainThreshold),
+    HOTFIELD(DamageFactor),
+    HOTFIELD(DamageMultiply),
+    HOTFIELD(Inventory),
+    HOTFIELD(player),
+    HOTFIELD(target),
+    HOTFIELD(lastenemy),
+    HOTFIELD(threshold),
+    HOTFIELD(velx),
+    HOTFIELD(vely),
+    HOTFIELD(velz),
+    HOTFIELD(state),
+    HOTFIELD(ObjectFlags),
+};
+
+#undef HOTFIELD
+
+enum { ACTOR_CACHE_LINE = 64 };
+
+static int STACK_ARGS P_CompareHotFields (const void *a, const void *b)
+{
+    size_t x = ((const FActorHotField *)a)->Offset;
+    size_t y = ((const FActorHotField *)b)->Offset;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// The fields in offset order, so neighbors in the same line are adjacent.
+static const FActorHotField *P_GetHotFields ()
+{
+    static bool sorted;
+
+    if (!sorted)
+    {
+        qsort (ActorHotFields, countof(ActorHotFields), sizeof(ActorHotFields[0]), P_CompareHotFields);
+        sorted = true;
+    }
+    return ActorHotFields;
+}
+
+// Number of distinct cache lines the hot fields of this actor occupy.
+static int P_CountHotLines (const AActor *actor)
+{
+    const FActorHotField *fields = P_GetHotFields();
+    size_t lastline = ~(size_t)0;
+    int count = 0;
+
+    for (size_t i = 0; i < countof(ActorHotFields); ++i)
+    {
+        size_t first = (size_t(actor) + fields[i].Offset) / ACTOR_CACHE_LINE;
+        size_t last = (size_t(actor) + fields[i].Offset + fields[i].Size - 1) / ACTOR_CACHE_LINE;
+        for (size_t line = first; line <= last; ++line)
+        {
+            if (line != lastline)
+            {
+                count++;
+                lastline = line;
+            }
+        }
+    }
+    return count;
+}
+
+static inline void P_PrefetchLine (const void *p)
+{
+#if defined(_MSC_VER)
+    _mm_prefetch ((const char *)p, _MM_HINT_T0);
+#elif defined(__GNUC__)
+    __builtin_prefetch (p);
+#endif
+}
+
+static inline void P_PrefetchActor (const AActor *actor)
+{
+    const FActorHotField *fields = P_GetHotFields();
+    size_t lastline = ~(size_t)0;
+
+    for (size_t i = 0; i < countof(ActorHotFields); ++i)
+    {
+        const char *p = (const char *)actor + fields[i].Offset;
+        size_t line = size_t(p) / ACTOR_CACHE_LINE;
+        if (line != lastline)
+        {
+            P_PrefetchLine (p);
+            lastline = line;
+        }
+    }
+}
+
+//==========================================================================
+//
+// P_DamageMobjBatch
+//
+// Damages several targets with one inflictor/source/damage type, as done
+// by splash damage, rail pierces and shotgun spreads. The per-target
+// results and the order in which the combat RNGs are consumed are exactly
+// those of calling P_DamageMobj for each target in turn; only the
+// inflictor and source side of the work is done once for the whole batch.
+//
+// damage holds one value per target. results may be NULL; otherwise it
+// receives what P_DamageMobj would have returned for each target.
+//
+//==========================================================================
+
+void P_DamageMobjBatch (AActor *const *targets, int numtargets, AActor *inflictor, AActor *source,
+    const int *damage, FName mod, int flags, int *results)
+{
+    enum { PREFETCH_DISTANCE = 4 };
+    FDamageContext ctx;
+
+    P_InitDamageContext (ctx, inflictor, source, mod, flags);
+
+    for (int i = 0; i < numtargets && i < PREFETCH_DISTANCE; ++i)
+    {
+        if (targets[i] != NULL) P_PrefetchActor (targets[i]);
+    }
+    for (int i = 0; i < numtargets; ++i)
+    {
+        if (i + PREFETCH_DISTANCE < numtargets && targets[i + PREFETCH_DISTANCE] != NULL)
+        {
+            P_PrefetchActor (targets[i + PREFETCH_DISTANCE]);
+        }
+        int result = P_DamageMobjTraced (targets[i], ctx, damage[i]);
+        if (results != NULL)
+        {
+            results[i] = result;
+        }
+    }
+}
+
+//==========================================================================
+//
+// benchdamage
+//
+// Drives synthetic scenarios through P_DamageMobj and AActor::Die and
+// reports the time per call and how each call ended. Each scenario spawns
+// its own actors around the console player, runs once timed and once
+// counting exits, and removes everything it spawned again; no thinkers
+// run in between and nothing needs a renderer or sound device, so this
+// works in a -nosound run with e.g. "+map map01 +benchdamage all". The
+// player scenario puts the console player, their inventory and what they
+// carry back the way they were. It draws from the game's random number
+// generators, so it refuses to run in netgames and demos. The predict
+// scenario runs every hit under a combat snapshot and rolls it back, and
+// reports the targets that did not come back the way they were spawned.
+// "benchdamage layout" shows how the hot actor fields sit in the cache.
+//
+//==========================================================================
+
+struct FDamageBenchScenario
+{
+    const char *Name;
+    const char *Description;
+    const char *MonsterClass;
+    int NumMonsters;
+    int NumHits;
+    int Damage;
+    FName Mod;
+    int DamageFlags;
+    int Setup;          // EDamageBenchSetup
+};
+
+enum EDamageBenchSetup
+{
+    DBS_Monsters,
+    DBS_Inventory,      // monsters carrying armor, protection and different filler items
+    DBS_Player,         // a monster hits the console player, carrying armor and protection
+    DBS_Spectral,
+    DBS_Invulnerable,
+    DBS_Buddha,
+    DBS_Predicted,      // every hit is predicted under a combat snapshot and rolled back
+};
+
+static const FDamageBenchScenario DamageBenchScenarios[] =
+{
+    { "hitscan",    "10k hitscan hits on 1000 monsters",        "DoomImp",      1000,   10000,  3,              NAME_None,      0,          DBS_Monsters },
+    { "inventory",  "10k hits on monsters with inventory",      "DoomImp",      1000,   10000,  3,              NAME_None,      0,          DBS_Inventory },
+    { "player",     "10k hits on an armored, protected player", "DoomImp",      1,      10000,  3,              NAME_None,      0,          DBS_Player },
+    { "spectral",   "10k hits on spectral monsters",            "DoomImp",      1000,   10000,  3,              NAME_None,      0,          DBS_Spectral },
+    { "invul",      "10k hits on invulnerable monsters",        "DoomImp",      1000,   10000,  3,              NAME_None,      0,          DBS_Invulnerable },
+    { "buddha",     "10k hits on buddha monsters",              "DoomImp",      1000,   10000,  1000,           NAME_None,      0,          DBS_Buddha },
+    { "massacre",   "massacre of 2000 monsters",                "DoomImp",      2000,   2000,   TELEFRAG_DAMAGE, NAME_Massacre, DMG_FORCED, DBS_Monsters },
+    { "ice",        "ice deaths of 2000 monsters",              "DoomImp",      2000,   2000,   1000,           NAME_Ice,       0,          DBS_Monsters },
+    { "fire",       "fire deaths of 2000 monsters",             "DoomImp",      2000,   2000,   1000,           NAME_Fire,      0,          DBS_Monsters },
+    { "extreme",    "extreme deaths of 2000 monsters",          "DoomImp",      2000,   2000,   100000,         NAME_None,      0,          DBS_Monsters },
+    { "predict",    "10k lethal hits predicted and rolled back", "DoomImp",      1000,   10000,  1000,           NAME_None,      0,          DBS_Predicted },
+};
+
+// Each a different class, so none of them stack.
+static const char *const DamageBenchItems[] =
+{
+    "BlueArmor", "PowerProtection", "Clip", "Shell", "RocketAmmo", "Cell",
+    "RedCard", "BlueCard", "YellowCard", "RedSkull", "BlueSkull", "YellowSkull",
+};
+
+static void P_GiveBenchItem (AActor *mo, const char *name)
+{
+    const PClass *cls = PClass::FindClass (name);
+    if (cls != NULL)
+    {
+        mo->GiveInventoryType (cls);
+    }
+}
+
+// What the player scenario changes about the console player.
+struct FDamageBenchPlayer
+{
+    FCombatActorState Actor;
+    FCombatPlayerState Player;
+    TArray<FCombatItemState> Items;
+    TArray<FCombatBasicArmorState> Armors;
+
+    void Save (player_t *player);
+    void Restore ();
+};
+
+void FDamageBenchPlayer::Save (player_t *player)
+{
+    Actor.Owner = player->mo;
+    Actor.Save ();
+    Player.Owner = player;
+    Player.Save ();
+    Items.Clear();
+    Armors.Clear();
+    for (AInventory *item = player->mo->Inventory; item != NULL; item = item->Inventory)
+    {
+        FCombatItemState &is = Items[Items.Reserve (1)];
+        is.Owner = item;
+        is.Save ();
+        if (item->IsKindOf (RUNTIME_CLASS(ABasicArmor)))
+        {
+            FCombatBasicArmorState &as = Armors[Armors.Reserve (1)];
+            as.Owner = static_cast<ABasicArmor *>(item);
+            as.Save ();
+        }
+    }
+}
+
+void FDamageBenchPlayer::Restore ()
+{
+    AActor *mo = Actor.Owner;
+
+    // Take away whatever the scenario gave.
+    for (AInventory *item = mo->Inventory, *next; item != NULL; item = next)
+    {
+        next = item->Inventory;
+
+        unsigned i;
+        for (i = 0; i < Items.Size() && Items[i].Owner != item; ++i)
+        {
+        }
+        if (i == Items.Size())
+        {
+            item->Destroy ();
+        }
+    }
+    for (unsigned i = 0; i < Armors.Size(); ++i)
+    {
+        Armors[i].Restore ();
+    }
+    for (unsigned i = 0; i < Items.Size(); ++i)
+    {
+        Items[i].Restore ();
+    }
+    Player.Restore ();
+    Actor.Restore ();
+    mo->InvalidateInventoryIndex ();
+}
+
+// Returns the actor the hits come from: the player, or for the player
+// scenario the monster it spawned to attack them.
+static AActor *P_SetupDamageBench (const FDamageBenchScenario &sc, TArray<AActor *> &targets)
+{
+    AActor *pmo = players[consoleplayer].mo;
+    const PClass *cls = sc.MonsterClass != NULL ? PClass::FindClass (sc.MonsterClass) : NULL;
+
+    targets.Clear();
+    if (cls == NULL)
+    {
+        return pmo;
+    }
+    if (sc.Setup == DBS_Player)
+    {
+        AActor *attacker = Spawn (cls, pmo->X(), pmo->Y() + 64*FRACUNIT, pmo->Z(), NO_REPLACE);
+        P_GiveBenchItem (pmo, "BlueArmor");
+        P_GiveBenchItem (pmo, "PowerProtection");
+        targets.Push (pmo);
+        return attacker;
+    }
+
+    int side = 1;
+    while (side * side < sc.NumMonsters) side++;
+
+    for (int i = 0; i < sc.NumMonsters; ++i)
+    {
+        fixed_t x = pmo->X() + ((i % side) - side/2) * 64*FRACUNIT;
+        fixed_t y = pmo->Y() + ((i / side) + 1) * 64*FRACUNIT;
+        AActor *mo = Spawn (cls, x, y, pmo->Z(), NO_REPLACE);
+
+        switch (sc.Setup)
+        {
+        case DBS_Inventory:
+            for (size_t j = 0; j < countof(DamageBenchItems); ++j)
+            {
+                P_GiveBenchItem (mo, DamageBenchItems[j]);
+            }
+            break;
+        case DBS_Spectral:
+            mo->flags4 |= MF4_SPECTRAL;
+            break;
+        case DBS_Invulnerable:
+            mo->flags2 |= MF2_INVULNERABLE;
+            break;
+        case DBS_Buddha:
+            mo->flags7 |= MF7_BUDDHA;
+            break;
+        }
+        targets.Push (mo);
+    }
+    return pmo;
+}
+
+static unsigned P_RunDamageBench (const FDamageBenchScenario &sc, TArray<AActor *> &targets, AActor *attacker)
+{
+    AActor *pmo = players[consoleplayer].mo;
+    AActor *source = sc.Mod == NAME_Massacre ? NULL : attacker;
+    unsigned calls = 0;
+    FCombatSnapshot snapshot;
+
+    if (targets.Size() == 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < sc.NumHits; ++i)
+    {
+        AActor *target = targets[i % targets.Size()];
+        if (sc.Setup == DBS_Player)
+        {
+            pmo->health = pmo->player->health = 100;
+        }
+        if (sc.Setup == DBS_Predicted)
+        {
+            snapshot.Begin ();
+            P_DamageMobj (target, source, source, sc.Damage, sc.Mod, sc.DamageFlags);
+            snapshot.Rollback ();
+        }
+        else
+        {
+            P_DamageMobj (target, source, source, sc.Damage, sc.Mod, sc.DamageFlags);
+        }
+        calls++;
+    }
+    return calls;
+}
+
+// Counts the targets a predicted scenario did not put back the way they
+// were spawned.
+static unsigned P_CheckDamageBenchRollback (TArray<AActor *> &targets)
+{
+    unsigned bad = 0;
+
+    for (unsigned i = 0; i < targets.Size(); ++i)
+    {
+        AActor *mo = targets[i];
+        if (mo->health != mo->SpawnHealth() || (mo->flags & MF_CORPSE) || mo->state != mo->SpawnState)
+        {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+static void P_CleanupDamageBench (TArray<AActor *> &targets, AActor *attacker)
+{
+    if (attacker != NULL && attacker != players[consoleplayer].mo)
+    {
+        attacker->Destroy ();
+    }
+    for (unsigned i = 0; i < targets.Size(); ++i)
+    {
+        if (targets[i] != players[consoleplayer].mo)
+        {
+            targets[i]->Destroy ();
+        }
+    }
+    targets.Clear();
+}
+
+static void P_BenchDamageScenario (const FDamageBenchScenario &sc)
+{
+    TArray<AActor *> targets;
+    unsigned counts[DTX_NUM];
+    player_t *player = &players[consoleplayer];
+    int savedkilled = level.killed_monsters, savedtotal = level.total_monsters;
+    FDamageBenchPlayer savedplayer;
+    AActor *attacker;
+    cycle_t timer;
+
+    savedplayer.Save (player);
+
+    // Timed pass
+    attacker = P_SetupDamageBench (sc, targets);
+    timer.Reset();
+    timer.Clock();
+    unsigned calls = P_RunDamageBench (sc, targets, attacker);
+    timer.Unclock();
+    P_CleanupDamageBench (targets, attacker);
+    savedplayer.Restore ();
+
+    // Counting pass
+    memset (counts, 0, sizeof(counts));
+    attacker = P_SetupDamageBench (sc, targets);
+    DamageExitCounts = counts;
+    P_RunDamageBench (sc, targets, attacker);
+    DamageExitCounts = NULL;
+    unsigned notrestored = sc.Setup == DBS_Predicted ? P_CheckDamageBenchRollback (targets) : 0;
+    P_CleanupDamageBench (targets, attacker);
+    savedplayer.Restore ();
+
+    level.killed_monsters = savedkilled;
+    level.total_monsters = savedtotal;
+    P_ClearPresentationEvents ();
+
+    double ms = timer.TimeMS();
+    Printf ("%-10s %-42s %7u calls %9.1f ns/call %11.0f calls/s\n", sc.Name, sc.Description,
+        calls, calls ? ms * 1e6 / calls : 0., ms > 0 ? calls * 1000. / ms : 0.);
+    for (int i = 0; i < DTX_NUM; ++i)
+    {
+        if (counts[i] != 0)
+        {
+            Printf ("           %-14s %u\n", DamageExitNames[i], counts[i]);
+        }
+    }
+    if (notrestored != 0)
+    {
+        Printf ("           %u of %d targets were not rolled back\n", notrestored, sc.NumMonsters);
+    }
+}
+
+// Hits 4000 monsters in a shuffled order, once one P_DamageMobj call at
+// a time and once through P_DamageMobjBatch, which prefetches the hot
+// lines of the targets ahead, and compares the time per hit. Also lists
+// where the hot fields are and how many cache lines they span per actor.
+// The actor's layout is left as it is and cache misses are not counted;
+// the timing difference is all this measures.
+static void P_BenchDamageLayout ()
+{
+    enum { NUM_TARGETS = 4000, NUM_HITS = 20000 };
+    static const FDamageBenchScenario sc =
+        { "layout", "hot field layout", "DoomImp", NUM_TARGETS, NUM_HITS, 1, NAME_None, 0, DBS_Monsters };
+    const FActorHotField *fields = P_GetHotFields();
+    TArray<AActor *> targets, order;
+    TArray<int> damage, results;
+    AActor *pmo = players[consoleplayer].mo;
+    int savedkilled = level.killed_monsters, savedtotal = level.total_monsters;
+    cycle_t single, batched;
+    double lines = 0;
+
+    // One call per hit
+    P_SetupDamageBench (sc, targets);
+    if (targets.Size() == 0)
+    {
+        return;
+    }
+    DWORD seed = 1;
+    order.Resize (NUM_HITS);
+    damage.Resize (NUM_HITS);
+    results.Resize (NUM_HITS);
+    for (int i = 0; i < NUM_HITS; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        order[i] = targets[(seed >> 8) % targets.Size()];
+        damage[i] = sc.Damage;
+        lines += P_CountHotLines (order[i]);
+    }
+    single.Reset();
+    single.Clock();
+    for (int i = 0; i < NUM_HITS; ++i)
+    {
+        P_DamageMobj (order[i], pmo, pmo, damage[i], sc.Mod, sc.DamageFlags);
+    }
+    single.Unclock();
+    P_CleanupDamageBench (targets, NULL);
+
+    // The same hits, batched
+    P_SetupDamageBench (sc, targets);
+    seed = 1;
+    for (int i = 0; i < NUM_HITS; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        order[i] = targets[(seed >> 8) % targets.Size()];
+    }
+    batched.Reset();
+    batched.Clock();
+    P_DamageMobjBatch (&order[0], NUM_HITS, pmo, pmo, &damage[0], sc.Mod, sc.DamageFlags, &results[0]);
+    batched.Unclock();
+    P_CleanupDamageBench (targets, NULL);
+
+    level.killed_monsters = savedkilled;
+    level.total_monsters = savedtotal;
+    P_ClearPresentationEvents ();
+
+    Printf ("AActor is %u bytes (%u cache lines); %u hot fields span %.2f lines per actor\n",
+        (unsigned)sizeof(AActor), unsigned((sizeof(AActor) + ACTOR_CACHE_LINE - 1) / ACTOR_CACHE_LINE),
+        (unsigned)countof(ActorHotFields), lines / NUM_HITS);
+    for (size_t i = 0; i < countof(ActorHotFields); ++i)
+    {
+        Printf ("    %-16s %5u\n", fields[i].Name, (unsigned)fields[i].Offset);
+    }
+    Printf ("%-10s %-42s %7u calls %9.1f ns/call\n", "single", "shuffled hits, one call each",
+        (unsigned)NUM_HITS, single.TimeMS() * 1e6 / NUM_HITS);
+    Printf ("%-10s %-42s %7u calls %9.1f ns/call\n", "batched", "shuffled hits, hot lines prefetched",
+        (unsigned)NUM_HITS, batched.TimeMS() * 1e6 / NUM_HITS);
+}
+
+CCMD (benchdamage)
+{
+    if (netgame || demorecording || demoplayback)
+    {
+        Printf ("benchdamage can't be used in netgames or demos\n");
+        return;
+    }
+    if (gamestate != GS_LEVEL || players[consoleplayer].mo == NULL)
+    {
+        Printf ("benchdamage needs a level with a player in it\n");
+        return;
+    }
+
+    const char *which = argv.argc() >= 2 ? argv[1] : "all";
+    bool found = false;
+
+    // Kill messages, sounds and rumble only get queued, and each scenario
+    // throws them away, so the timings are of the damage path alone.
+    bool drained = PresentationDrained;
+    PresentationDrained = true;
+
+    for (size_t i = 0; i < countof(DamageBenchScenarios); ++i)
+    {
+        if (!stricmp (which, "all") || !stricmp (which, DamageBenchScenarios[i].Name))
+        {
+            P_BenchDamageScenario (DamageBenchScenarios[i]);
+            found = true;
+        }
+    }
+    if (!stricmp (which, "all") || !stricmp (which, "layout"))
+    {
+        P_BenchDamageLayout ();
+        found = true;
+    }
+    PresentationDrained = drained;
+    if (!found)
+    {
+        Printf ("Usage: benchdamage [all|layout");
+        for (size_t i = 0; i < countof(DamageBenchScenarios); ++i)
+        {
+            Printf ("|%s", DamageBenchScenarios[i].Name);
+        }
+        Printf ("]\n");
+    }
+}